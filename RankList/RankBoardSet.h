@@ -0,0 +1,363 @@
+#pragma once
+
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "RankList.h"
+
+template<typename TBoard, RankID TID, RankScore TScore, int N = 4>
+class CRankBoardSet
+{
+public:
+    using TRankNode = CRankNode<TID, TScore>;
+    using TRankPool = CRankPool<TID, TScore>;
+    using TRankList = CRankList<TID, TScore, N>;
+
+    class CRankBoard;
+
+    using TIndexEntries = std::vector<std::pair<CRankBoard*, TRankNode*>>;
+    using TNodeIndex = std::unordered_map<TID, TIndexEntries, std::hash<TID>, std::equal_to<TID>, CRankPageAllocator<std::pair<const TID, TIndexEntries>>>;
+
+    // A board is a list whose IDs are indexed by the set, so only the calls
+    // that keep the index in step are public. Clear, Swap, rebuilds and the
+    // rest of CRankList would replace the list or its nodes without telling
+    // the index, which would then point at nodes another board reuses.
+    class CRankBoard : private TRankList
+    {
+    public:
+        using TRankList::GetScore;
+        using TRankList::GetRank;
+        using TRankList::GetRanks;
+        using TRankList::SetRank;
+        using TRankList::RemoveRank;
+        using TRankList::GetRankList;
+        using TRankList::SetEventSink;
+        using TRankList::Subscribe;
+        using TRankList::Unsubscribe;
+        using TRankList::Validate;
+        using TRankList::Print;
+        using TRankList::GetMaxLevel;
+
+    public:
+        CRankBoard (CRankBoardSet& _rkBoardSet, TBoard _kBoard)
+            : TRankList (&_rkBoardSet.m_kPool)
+            , m_rkBoardSet (_rkBoardSet)
+            , m_kBoard (_kBoard)
+        {
+        }
+
+        virtual ~CRankBoard ()
+        {
+            ClearBoard ();
+        }
+
+        TBoard GetBoard () const
+        {
+            return m_kBoard;
+        }
+
+        bool IsEmpty () const
+        {
+            return this->m_pkRoot == nullptr;
+        }
+
+        int GetNodeRank (TRankNode* _pkNode)
+        {
+            return this->CalcRank (_pkNode) + 1;
+        }
+
+        void ClearBoard ()
+        {
+            TRankNode* node = this->GetBottomNode (this->m_pkRoot);
+            while (node != nullptr)
+            {
+                RemoveMapNode (node->m_pkEntry->m_nID);
+                node = node->m_pkNext;
+            }
+
+            this->Clear ();
+        }
+
+    protected:
+        TRankNode* GetMapNode (const TID& _nID) override
+        {
+            return m_rkBoardSet.GetIndexNode (this, _nID);
+        }
+
+        void SetMapNode (TRankNode* _pkNode) override
+        {
+            if (_pkNode == nullptr) {
+                return;
+            }
+
+            m_rkBoardSet.SetIndexNode (this, _pkNode);
+        }
+
+        void RemoveMapNode (const TID& _nID) override
+        {
+            m_rkBoardSet.RemoveIndexNode (this, _nID);
+        }
+
+    private:
+        CRankBoardSet& m_rkBoardSet;
+        TBoard m_kBoard;
+    };
+
+public:
+    CRankBoardSet ()
+    {
+    }
+
+    CRankBoardSet (const CRankBoardSet&) = delete;
+
+    virtual ~CRankBoardSet ()
+    {
+        Clear ();
+    }
+
+    CRankBoard* GetBoard (TBoard _kBoard)
+    {
+        auto it = m_kBoards.find (_kBoard);
+        if (it == m_kBoards.end ()) {
+            return nullptr;
+        }
+
+        return it->second;
+    }
+
+    CRankBoard* CreateBoard (TBoard _kBoard)
+    {
+        auto it = m_kBoards.find (_kBoard);
+        if (it != m_kBoards.end ()) {
+            return it->second;
+        }
+
+        CRankBoard* board = new CRankBoard (*this, _kBoard);
+        m_kBoards.emplace (_kBoard, board);
+
+        return board;
+    }
+
+    void RemoveBoard (TBoard _kBoard)
+    {
+        auto it = m_kBoards.find (_kBoard);
+        if (it == m_kBoards.end ()) {
+            return;
+        }
+
+        delete it->second;
+        m_kBoards.erase (it);
+    }
+
+    int GetBoardCount () const
+    {
+        return static_cast<int> (m_kBoards.size ());
+    }
+
+    TScore GetScore (TBoard _kBoard, TID _nID)
+    {
+        CRankBoard* board = GetBoard (_kBoard);
+        if (board == nullptr) {
+            return TScore ();
+        }
+
+        return board->GetScore (_nID);
+    }
+
+    int GetRank (TBoard _kBoard, TID _nID)
+    {
+        CRankBoard* board = GetBoard (_kBoard);
+        if (board == nullptr) {
+            return 0;
+        }
+
+        return board->GetRank (_nID);
+    }
+
+    void SetRank (TBoard _kBoard, TID _nID, TScore _nScore)
+    {
+        CreateBoard (_kBoard)->SetRank (std::move (_nID), std::move (_nScore));
+    }
+
+    void RemoveRank (TBoard _kBoard, TID _nID)
+    {
+        auto it = m_kBoards.find (_kBoard);
+        if (it == m_kBoards.end ()) {
+            return;
+        }
+
+        CRankBoard* board = it->second;
+        board->RemoveRank (_nID);
+
+        if (board->IsEmpty ())
+        {
+            delete board;
+            m_kBoards.erase (it);
+        }
+    }
+
+    void GetRanks (TID _nID, std::vector<std::tuple<TBoard, int, TScore>>& _rkRanks)
+    {
+        _rkRanks.clear ();
+
+        auto it = m_kNodeIndex.find (_nID);
+        if (it == m_kNodeIndex.end ()) {
+            return;
+        }
+
+        _rkRanks.reserve (it->second.size ());
+
+        for (auto& entry : it->second) {
+            _rkRanks.emplace_back (entry.first->GetBoard (), entry.first->GetNodeRank (entry.second), entry.second->m_pkEntry->m_nScore);
+        }
+    }
+
+    // Validates every board, then checks that each index entry points at
+    // the tower top of a live board.
+    bool Validate (std::string& _rkError)
+    {
+        _rkError.clear ();
+
+        size_t count = 0;
+
+        for (auto& board : m_kBoards)
+        {
+            if (!board.second->Validate (_rkError))
+            {
+                _rkError = "board " + std::to_string (count) + ": " + _rkError;
+                return false;
+            }
+
+            count++;
+        }
+
+        std::unordered_set<CRankBoard*> boards;
+        for (auto& board : m_kBoards) {
+            boards.emplace (board.second);
+        }
+
+        for (auto& index : m_kNodeIndex)
+        {
+            if (index.second.empty ())
+            {
+                _rkError = "index keeps an ID with no boards";
+                return false;
+            }
+
+            for (auto& entry : index.second)
+            {
+                if (boards.find (entry.first) == boards.end ())
+                {
+                    _rkError = "index entry for a removed board";
+                    return false;
+                }
+
+                if (entry.second->m_pkUp != nullptr || !(entry.second->m_pkEntry->m_nID == index.first))
+                {
+                    _rkError = "index entry is not the tower top of its ID";
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Placement of the shared pool and the index, see CRankList::SetPlacement.
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        m_kPool.SetPlacement (_bHugePages, _nNumaNode);
+
+        CRankPageAllocator<std::pair<const TID, TIndexEntries>> allocator (m_kPool.IsHugePages (), m_kPool.GetNumaNode ());
+
+        TNodeIndex nodeIndex (m_kNodeIndex.bucket_count (), m_kNodeIndex.hash_function (), m_kNodeIndex.key_eq (), allocator);
+        for (auto& entries : m_kNodeIndex) {
+            nodeIndex.emplace (entries.first, std::move (entries.second));
+        }
+
+        m_kNodeIndex.swap (nodeIndex);
+    }
+
+    void SetUpperLevel (int _nUpperLevel)
+    {
+        m_kPool.SetUpperLevel (_nUpperLevel);
+    }
+
+    void Clear ()
+    {
+        for (auto& board : m_kBoards) {
+            delete board.second;
+        }
+
+        m_kBoards.clear ();
+        m_kNodeIndex.clear ();
+        m_kPool.Clear ();
+    }
+
+private:
+    TRankNode* GetIndexNode (CRankBoard* _pkBoard, const TID& _nID)
+    {
+        auto it = m_kNodeIndex.find (_nID);
+        if (it == m_kNodeIndex.end ()) {
+            return nullptr;
+        }
+
+        for (auto& entry : it->second)
+        {
+            if (entry.first == _pkBoard) {
+                return entry.second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void SetIndexNode (CRankBoard* _pkBoard, TRankNode* _pkNode)
+    {
+        auto& entries = m_kNodeIndex[_pkNode->m_pkEntry->m_nID];
+
+        for (auto& entry : entries)
+        {
+            if (entry.first == _pkBoard)
+            {
+                entry.second = _pkNode;
+                return;
+            }
+        }
+
+        entries.emplace_back (_pkBoard, _pkNode);
+    }
+
+    void RemoveIndexNode (CRankBoard* _pkBoard, const TID& _nID)
+    {
+        auto it = m_kNodeIndex.find (_nID);
+        if (it == m_kNodeIndex.end ()) {
+            return;
+        }
+
+        auto& entries = it->second;
+        for (auto entry = entries.begin (); entry != entries.end (); entry++)
+        {
+            if (entry->first == _pkBoard)
+            {
+                *entry = entries.back ();
+                entries.pop_back ();
+
+                if (entries.empty ()) {
+                    m_kNodeIndex.erase (it);
+                }
+
+                return;
+            }
+        }
+    }
+
+private:
+    TRankPool m_kPool;
+    TNodeIndex m_kNodeIndex;
+    std::unordered_map<TBoard, CRankBoard*> m_kBoards;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "RankList.h"
+
+enum class ERankRead
+{
+    Ok,
+    Empty,
+    Lost,
+};
+
+// Broadcast ring of rank events. One writer pushes, any number of readers
+// keep their own cursor and never block it. Slots are guarded by a sequence
+// number and copied word by word through atomics, so a slot being
+// overwritten is detected instead of read torn. A reader that falls more
+// than Capacity events behind gets Lost and should reload its window.
+template<typename TID, typename TScore, int Capacity = 4096>
+class CRankEventStream : public CRankEventSink<TID, TScore>
+{
+public:
+    using TRankEvent = CRankEvent<TID, TScore>;
+
+    static_assert (std::is_trivially_copyable<TRankEvent>::value, "CRankEventStream needs trivially copyable TID and TScore");
+    static_assert (Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    static constexpr int Words = (sizeof (TRankEvent) + sizeof (uint64_t) - 1) / sizeof (uint64_t);
+
+    class CRankSlot
+    {
+    public:
+        CRankSlot ()
+            : m_nSeq (0)
+        {
+            for (auto& word : m_kWords) {
+                word.store (0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint64_t> m_nSeq;
+        std::atomic<uint64_t> m_kWords[Words];
+    };
+
+public:
+    CRankEventStream ()
+        : m_nHead (0)
+        , m_pkSlots (new CRankSlot[Capacity])
+    {
+    }
+
+    CRankEventStream (const CRankEventStream&) = delete;
+
+    virtual ~CRankEventStream ()
+    {
+        delete[] m_pkSlots;
+    }
+
+    // Sequence of the next event; a new reader starts here.
+    uint64_t GetHead () const
+    {
+        return m_nHead.load (std::memory_order_acquire);
+    }
+
+    void PushEvent (const TRankEvent& _rkEvent) override
+    {
+        uint64_t seq = m_nHead.load (std::memory_order_relaxed);
+        CRankSlot& slot = m_pkSlots[seq & (Capacity - 1)];
+
+        uint64_t words[Words] = {};
+        std::memcpy (words, &_rkEvent, sizeof (TRankEvent));
+
+        // 0 marks the slot as being written; published slots hold seq + 1.
+        // The release stores keep that mark ahead of every new word.
+        slot.m_nSeq.store (0, std::memory_order_relaxed);
+
+        for (int i = 0; i < Words; i++) {
+            slot.m_kWords[i].store (words[i], std::memory_order_release);
+        }
+
+        slot.m_nSeq.store (seq + 1, std::memory_order_release);
+        m_nHead.store (seq + 1, std::memory_order_release);
+    }
+
+    // Reads the event at _rnCursor and advances it. On Lost the cursor is
+    // moved to the head.
+    ERankRead Read (uint64_t& _rnCursor, TRankEvent& _rkEvent)
+    {
+        uint64_t head = m_nHead.load (std::memory_order_acquire);
+        if (_rnCursor >= head) {
+            return ERankRead::Empty;
+        }
+
+        if (head - _rnCursor > static_cast<uint64_t> (Capacity))
+        {
+            _rnCursor = head;
+            return ERankRead::Lost;
+        }
+
+        CRankSlot& slot = m_pkSlots[_rnCursor & (Capacity - 1)];
+
+        uint64_t seq = slot.m_nSeq.load (std::memory_order_acquire);
+
+        uint64_t words[Words];
+        for (int i = 0; i < Words; i++) {
+            words[i] = slot.m_kWords[i].load (std::memory_order_acquire);
+        }
+
+        if (seq != _rnCursor + 1 || slot.m_nSeq.load (std::memory_order_relaxed) != seq)
+        {
+            _rnCursor = m_nHead.load (std::memory_order_acquire);
+            return ERankRead::Lost;
+        }
+
+        std::memcpy (&_rkEvent, words, sizeof (TRankEvent));
+        _rnCursor++;
+
+        return ERankRead::Ok;
+    }
+
+private:
+    alignas (64) std::atomic<uint64_t> m_nHead;
+    CRankSlot* m_pkSlots;
+};
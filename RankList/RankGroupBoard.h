@@ -0,0 +1,430 @@
+#pragma once
+
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "RankList.h"
+
+enum class ERankAggregate
+{
+    Sum,
+    Max,
+    TopSum,
+};
+
+// Ranks members and the groups they belong to. Members live in one list
+// ordered by (group slot, score), so each group is a contiguous run and a
+// member's rank inside its group is its rank minus the start of the run.
+// Group totals are marked dirty by member writes and reranked on Tick.
+// Sum and TopSum need TScore to support + and -.
+template<RankID TGroup, RankID TID, RankScore TScore, int N = 4>
+class CRankGroupBoard
+{
+public:
+    using TMemberScore = std::pair<int, TScore>;
+    using TGroupList = CRankList<TGroup, TScore, N>;
+
+    class CRankMemberList : public CRankList<TID, TMemberScore, N>
+    {
+    public:
+        using TRankNode = typename CRankList<TID, TMemberScore, N>::TRankNode;
+
+    public:
+        const TMemberScore* FindScore (const TID& _nID)
+        {
+            TRankNode* mapNode = this->GetMapNode (_nID);
+            if (mapNode == nullptr) {
+                return nullptr;
+            }
+
+            return &mapNode->m_pkEntry->m_nScore;
+        }
+
+        // Number of members in groups ordered before _nSlot.
+        int GetGroupStart (int _nSlot)
+        {
+            return this->CountWhile ([_nSlot] (const TMemberScore& _rkScore) { return _rkScore.first > _nSlot; });
+        }
+
+        TRankNode* GetGroupNode (int _nSlot, int _nRank)
+        {
+            return this->GetBottomNode (this->QueryRank (GetGroupStart (_nSlot) + _nRank));
+        }
+    };
+
+    class CRankGroup
+    {
+    public:
+        CRankGroup ()
+            : m_nSlot (0)
+            , m_nCount (0)
+            , m_nTotal ()
+            , m_bDirty (false)
+        {
+        }
+
+        int m_nSlot;
+        int m_nCount;
+        TScore m_nTotal;
+        bool m_bDirty;
+    };
+
+public:
+    explicit CRankGroupBoard (ERankAggregate _eAggregate = ERankAggregate::Sum, int _nTopSize = 1)
+        : m_eAggregate (_eAggregate)
+        , m_nTopSize (std::max (_nTopSize, 1))
+    {
+    }
+
+    CRankGroupBoard (const CRankGroupBoard&) = delete;
+
+    virtual ~CRankGroupBoard ()
+    {
+    }
+
+    bool GetGroup (TID _nID, TGroup& _rkGroup)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return false;
+        }
+
+        _rkGroup = m_kSlots[score->first];
+
+        return true;
+    }
+
+    TScore GetScore (TID _nID)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return TScore ();
+        }
+
+        return score->second;
+    }
+
+    // Rank of _nID inside its group.
+    int GetRank (TID _nID)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return 0;
+        }
+
+        return m_kMemberList.GetRank (_nID) - m_kMemberList.GetGroupStart (score->first);
+    }
+
+    // Rank of the group of _nID as of the last Tick, and the rank of _nID
+    // inside it.
+    std::pair<int, int> GetRanks (TID _nID)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return std::make_pair (0, 0);
+        }
+
+        int groupRank = m_kGroupList.GetRank (m_kSlots[score->first]);
+        int rank = m_kMemberList.GetRank (_nID) - m_kMemberList.GetGroupStart (score->first);
+
+        return std::make_pair (groupRank, rank);
+    }
+
+    TScore GetGroupScore (TGroup _kGroup)
+    {
+        return m_kGroupList.GetScore (_kGroup);
+    }
+
+    int GetGroupRank (TGroup _kGroup)
+    {
+        return m_kGroupList.GetRank (_kGroup);
+    }
+
+    int GetGroupSize (TGroup _kGroup)
+    {
+        auto it = m_kGroups.find (_kGroup);
+        if (it == m_kGroups.end ()) {
+            return 0;
+        }
+
+        return it->second.m_nCount;
+    }
+
+    void GetGroupList (int _nRank, int _nSize, std::vector<std::pair<TGroup, TScore>>& _rkGroupList)
+    {
+        m_kGroupList.GetRankList (_nRank, _nSize, _rkGroupList);
+    }
+
+    void GetMemberList (TGroup _kGroup, int _nRank, int _nSize, std::vector<std::pair<TID, TScore>>& _rkMemberList)
+    {
+        _rkMemberList.clear ();
+
+        auto it = m_kGroups.find (_kGroup);
+        if (it == m_kGroups.end ()) {
+            return;
+        }
+
+        int count = it->second.m_nCount;
+        if (_nRank < 1 || _nRank > count) {
+            return;
+        }
+
+        count = std::min (_nSize, count - _nRank + 1);
+        _rkMemberList.reserve (count);
+
+        auto node = m_kMemberList.GetGroupNode (it->second.m_nSlot, _nRank);
+        while (node != nullptr && count > 0)
+        {
+            _rkMemberList.emplace_back (node->m_pkEntry->m_nID, node->m_pkEntry->m_nScore.second);
+            node = node->m_pkNext;
+            count--;
+        }
+    }
+
+    void SetRank (TGroup _kGroup, TID _nID, TScore _nScore)
+    {
+        CRankGroup& group = GetOrCreateGroup (_kGroup);
+
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score != nullptr && score->first != group.m_nSlot) {
+            RemoveRank (_nID);
+            score = nullptr;
+        }
+
+        if (m_eAggregate == ERankAggregate::Sum)
+        {
+            if (score != nullptr) {
+                group.m_nTotal = group.m_nTotal - score->second;
+            }
+
+            group.m_nTotal = group.m_nTotal + _nScore;
+        }
+
+        if (score == nullptr) {
+            group.m_nCount++;
+        }
+
+        MarkDirty (_kGroup, group);
+
+        m_kMemberList.SetRank (std::move (_nID), std::make_pair (group.m_nSlot, std::move (_nScore)));
+    }
+
+    // Moves _nID to _kGroup and keeps its score.
+    void SetGroup (TID _nID, TGroup _kGroup)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return;
+        }
+
+        SetRank (std::move (_kGroup), std::move (_nID), score->second);
+    }
+
+    void RemoveRank (TID _nID)
+    {
+        const TMemberScore* score = m_kMemberList.FindScore (_nID);
+        if (score == nullptr) {
+            return;
+        }
+
+        const TGroup& groupID = m_kSlots[score->first];
+        CRankGroup& group = m_kGroups[groupID];
+
+        if (m_eAggregate == ERankAggregate::Sum) {
+            group.m_nTotal = group.m_nTotal - score->second;
+        }
+
+        group.m_nCount--;
+
+        MarkDirty (groupID, group);
+
+        m_kMemberList.RemoveRank (std::move (_nID));
+    }
+
+    // Reranks every group touched since the last Tick, once each. Groups
+    // left without members are removed. Returns the number of groups
+    // reranked.
+    int Tick ()
+    {
+        int count = static_cast<int> (m_kDirty.size ());
+
+        for (auto& groupID : m_kDirty)
+        {
+            auto it = m_kGroups.find (groupID);
+            if (it == m_kGroups.end ()) {
+                continue;
+            }
+
+            CRankGroup& group = it->second;
+            group.m_bDirty = false;
+
+            if (group.m_nCount <= 0)
+            {
+                m_kGroupList.RemoveRank (groupID);
+                m_kFreeSlots.emplace_back (group.m_nSlot);
+                m_kGroups.erase (it);
+                continue;
+            }
+
+            if (m_eAggregate != ERankAggregate::Sum) {
+                group.m_nTotal = CalcTotal (group);
+            }
+
+            m_kGroupList.SetRank (groupID, group.m_nTotal);
+        }
+
+        m_kDirty.clear ();
+
+        return count;
+    }
+
+    // Validates both lists and checks group member counts against the
+    // member list. Sum totals, kept up to date by every write, are checked
+    // against the members of every group; the group list is only checked for
+    // groups reranked by Tick.
+    bool Validate (std::string& _rkError)
+    {
+        if (!m_kMemberList.Validate (_rkError))
+        {
+            _rkError = "member list: " + _rkError;
+            return false;
+        }
+
+        if (!m_kGroupList.Validate (_rkError))
+        {
+            _rkError = "group list: " + _rkError;
+            return false;
+        }
+
+        for (auto& it : m_kGroups)
+        {
+            const CRankGroup& group = it.second;
+
+            int start = m_kMemberList.GetGroupStart (group.m_nSlot);
+            int end = m_kMemberList.GetGroupStart (group.m_nSlot - 1);
+            if (end - start != group.m_nCount)
+            {
+                _rkError = "group slot " + std::to_string (group.m_nSlot) + ": count " + std::to_string (group.m_nCount) + ", members " + std::to_string (end - start);
+                return false;
+            }
+
+            if (m_eAggregate == ERankAggregate::Sum && !IsSumExact (group))
+            {
+                _rkError = "group slot " + std::to_string (group.m_nSlot) + ": total differs from its members";
+                return false;
+            }
+
+            if (!group.m_bDirty && group.m_nCount > 0)
+            {
+                TScore total = m_eAggregate == ERankAggregate::Sum ? group.m_nTotal : CalcTotal (group);
+                if (!(total == m_kGroupList.GetScore (it.first)))
+                {
+                    _rkError = "group slot " + std::to_string (group.m_nSlot) + ": stale total";
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void Clear ()
+    {
+        m_kMemberList.Clear ();
+        m_kGroupList.Clear ();
+        m_kGroups.clear ();
+        m_kSlots.clear ();
+        m_kFreeSlots.clear ();
+        m_kDirty.clear ();
+    }
+
+private:
+    CRankGroup& GetOrCreateGroup (const TGroup& _kGroup)
+    {
+        auto it = m_kGroups.find (_kGroup);
+        if (it != m_kGroups.end ()) {
+            return it->second;
+        }
+
+        CRankGroup& group = m_kGroups[_kGroup];
+        group.m_nTotal = TScore ();
+
+        if (!m_kFreeSlots.empty ())
+        {
+            group.m_nSlot = m_kFreeSlots.back ();
+            m_kFreeSlots.pop_back ();
+
+            m_kSlots[group.m_nSlot] = _kGroup;
+        }
+        else
+        {
+            group.m_nSlot = static_cast<int> (m_kSlots.size ());
+            m_kSlots.emplace_back (_kGroup);
+        }
+
+        return group;
+    }
+
+    void MarkDirty (const TGroup& _kGroup, CRankGroup& _rkGroup)
+    {
+        if (_rkGroup.m_bDirty) {
+            return;
+        }
+
+        _rkGroup.m_bDirty = true;
+        m_kDirty.emplace_back (_kGroup);
+    }
+
+    // Max is the head of the group's run, TopSum adds up its first
+    // m_nTopSize members and Sum all of them.
+    TScore CalcTotal (const CRankGroup& _rkGroup)
+    {
+        auto node = m_kMemberList.GetGroupNode (_rkGroup.m_nSlot, 1);
+        if (node == nullptr) {
+            return TScore ();
+        }
+
+        if (m_eAggregate == ERankAggregate::Max) {
+            return node->m_pkEntry->m_nScore.second;
+        }
+
+        TScore total = TScore ();
+
+        int count = m_eAggregate == ERankAggregate::Sum ? _rkGroup.m_nCount : std::min (m_nTopSize, _rkGroup.m_nCount);
+        while (node != nullptr && count > 0)
+        {
+            total = total + node->m_pkEntry->m_nScore.second;
+            node = node->m_pkNext;
+            count--;
+        }
+
+        return total;
+    }
+
+    // A floating point Sum total picks up rounding from every add and
+    // subtract, so it cannot be compared exactly with a fresh sum.
+    bool IsSumExact (const CRankGroup& _rkGroup)
+    {
+        if constexpr (std::is_floating_point<TScore>::value) {
+            return true;
+        }
+        else {
+            return CalcTotal (_rkGroup) == _rkGroup.m_nTotal;
+        }
+    }
+
+private:
+    ERankAggregate m_eAggregate;
+    int m_nTopSize;
+
+    CRankMemberList m_kMemberList;
+    TGroupList m_kGroupList;
+
+    std::unordered_map<TGroup, CRankGroup> m_kGroups;
+    std::vector<TGroup> m_kSlots;
+    std::vector<int> m_kFreeSlots;
+    std::vector<TGroup> m_kDirty;
+};
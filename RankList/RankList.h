@@ -1,18 +1,88 @@
-﻿#include <iostream>
+﻿#pragma once
 
+#include <iostream>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
 #include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <span>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "RankMemory.h"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+template<typename T>
+concept RankID = std::copyable<T> && std::default_initializable<T> && std::equality_comparable<T> && requires (const T& _rkID)
+{
+    { std::hash<T> {} (_rkID) } -> std::convertible_to<size_t>;
+};
+
+template<typename T>
+concept RankScore = std::copyable<T> && std::default_initializable<T> && std::totally_ordered<T>;
+
+// The payload of one ranked ID. Every level of its tower points to the same
+// entry, so promotion and root rotation only move pointers.
+template<typename TID, typename TScore>
+class CRankEntry
+{
+public:
+    CRankEntry ()
+        : m_nID ()
+        , m_nScore ()
+    {
+    }
+
+    TID m_nID;
+    TScore m_nScore;
+};
+
+// Scores that are as cheap to copy as a pointer are also kept in each node,
+// so descents compare without loading the entry.
+template<typename TScore, bool Cached = std::is_trivially_copyable<TScore>::value && sizeof (TScore) <= sizeof (void*)>
+class CRankKey
+{
+public:
+    static constexpr bool IsCached = true;
+
+    CRankKey ()
+        : m_nKey ()
+    {
+    }
+
+    TScore m_nKey;
+};
+
+template<typename TScore>
+class CRankKey<TScore, false>
+{
+public:
+    static constexpr bool IsCached = false;
+};
+
 template<typename TID, typename TScore>
-class CRankNode
+class CRankNode : public CRankKey<TScore>
 {
 public:
-    CRankNode (int _nLevel, int _nCount, TID _nID, TScore _nScore)
-        : m_nLevel (_nLevel)
-        , m_nCount (_nCount)
-        , m_nID (_nID)
-        , m_nScore (_nScore)
+    using TRankEntry = CRankEntry<TID, TScore>;
+
+public:
+    CRankNode ()
+        : m_nLevel (0)
+        , m_nCount (0)
+        , m_pkEntry (nullptr)
         , m_pkUp (nullptr)
         , m_pkDown (nullptr)
         , m_pkPrev (nullptr)
@@ -20,14 +90,9 @@ public:
     {
     }
 
-    virtual ~CRankNode ()
-    {
-    }
-
     int m_nLevel;
     int m_nCount;
-    TID m_nID;
-    TScore m_nScore;
+    TRankEntry* m_pkEntry;
 
     CRankNode* m_pkUp;
     CRankNode* m_pkDown;
@@ -35,215 +100,1526 @@ public:
     CRankNode* m_pkNext;
 };
 
-template<typename TID, typename TScore, int N = 4>
-class CRankList
+// Storage for one node of a CRankList ID map: room for two links and the
+// pair, which covers a cached hash in place of the second link.
+template<typename TID, typename TScore>
+class CRankMapSlot
 {
 public:
-    using TRankNode = CRankNode<TID, TScore>;
+    alignas (std::pair<const TID, CRankNode<TID, TScore>*>) alignas (void*) unsigned char m_kBytes[2 * sizeof (void*) + sizeof (std::pair<const TID, CRankNode<TID, TScore>*>)];
+};
 
+enum class ERankEvent
+{
+    Enter,
+    Leave,
+    Move,
+    Reset,
+};
+
+// One change to a subscribed window. Ranks are 0 when the ID is not ranked
+// on that side of the write; Reset means the list was cleared.
+template<typename TID, typename TScore>
+class CRankEvent
+{
 public:
-    CRankList ()
-        : m_pkRoot (nullptr)
+    CRankEvent ()
+        : m_eType (ERankEvent::Reset)
+        , m_nWindow (0)
+        , m_nOldRank (0)
+        , m_nNewRank (0)
+        , m_nID ()
+        , m_nScore ()
     {
     }
 
-    CRankList (const CRankList&) = delete;
+    ERankEvent m_eType;
+    int m_nWindow;
+    int m_nOldRank;
+    int m_nNewRank;
+    TID m_nID;
+    TScore m_nScore;
+};
 
-    virtual ~CRankList ()
+template<typename TID, typename TScore>
+class CRankEventSink
+{
+public:
+    using TRankEvent = CRankEvent<TID, TScore>;
+
+public:
+    virtual ~CRankEventSink ()
     {
-        Clear ();
     }
 
-    TScore GetScore (TID _nID)
+    virtual void PushEvent (const TRankEvent& _rkEvent) = 0;
+};
+
+template<typename T>
+class CRankArena
+{
+public:
+    static constexpr int MinBlockSize = 16;
+    static constexpr int MaxBlockSize = 4096;
+    static constexpr size_t FreeChunkSize = 4096;
+
+    class CRankBlock
     {
-        TRankNode* mapNode = GetMapNode (_nID);
-        if (mapNode == nullptr) {
-            return 0;
+    public:
+        CRankBlock (T* _pkObjects, int _nSize, bool _bPaged, bool _bHugePages)
+            : m_pkObjects (_pkObjects)
+            , m_nSize (_nSize)
+            , m_bPaged (_bPaged)
+            , m_bHugePages (_bHugePages)
+        {
         }
 
-        return mapNode->m_nScore;
+        T* m_pkObjects;
+        int m_nSize;
+        bool m_bPaged;
+        bool m_bHugePages;
+    };
+
+public:
+    CRankArena ()
+        : m_nCapacity (0)
+        , m_nReserve (0)
+        , m_bHugePages (false)
+        , m_nNumaNode (-1)
+        , m_nFilled (0)
+        , m_nKept (0)
+    {
     }
 
-    int GetRank (TID _nID)
+    CRankArena (const CRankArena&) = delete;
+
+    virtual ~CRankArena ()
     {
-        TRankNode* mapNode = GetMapNode (_nID);
-        if (mapNode == nullptr) {
-            return 0;
+        Clear ();
+    }
+
+    T* Pop ()
+    {
+        if (m_kFree.empty ()) {
+            Refill ();
         }
 
-        return CalcRank (mapNode) + 1;
+        T* object = m_kFree.back ();
+        m_kFree.pop_back ();
+
+        return object;
     }
 
-    void SetRank (TID _nID, TScore _nScore)
+    void Push (T* _pkObject)
     {
-        TRankNode* mapNode = GetMapNode (_nID);
-        if (mapNode != nullptr && mapNode->m_nScore == _nScore) {
+        if (_pkObject == nullptr) {
             return;
         }
 
-        if (mapNode != nullptr) {
-            mapNode = GetBottomNode (mapNode);
+        if (m_kFree.size () == FreeChunkSize) {
+            PushChunk ();
+        }
 
-            bool hasChanged = false;
-            if (mapNode->m_pkPrev != nullptr) {
-                hasChanged |= _nScore >= mapNode->m_pkPrev->m_nScore;
-            }
+        m_kFree.emplace_back (_pkObject);
+    }
 
-            if (mapNode->m_pkNext != nullptr) {
-                hasChanged |= _nScore < mapNode->m_pkNext->m_nScore;
-            }
+    int GetLiveCount () const
+    {
+        return m_nCapacity - static_cast<int> (m_kChunks.size () * FreeChunkSize + m_kFree.size ());
+    }
 
-            if (hasChanged) {
-                RemoveRank (_nID);
-            }
-            else
-            {
-                while (mapNode != nullptr)
-                {
-                    mapNode->m_nScore = _nScore;
-                    mapNode = mapNode->m_pkUp;
-                }
+    void SetReserve (int _nReserve)
+    {
+        m_nReserve = std::max (_nReserve, 0);
+    }
 
-                return;
-            }
-        }
+    // Applies to blocks allocated from now on. Paged blocks are rounded up to
+    // whole pages: 2 MB ones with huge pages, normal ones for a NUMA node
+    // alone.
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        m_bHugePages = _bHugePages;
+        m_nNumaNode = _nNumaNode;
+    }
 
-        if (m_pkRoot == nullptr) {
-            CreateRoot (_nID, _nScore);
+    // Treats every object as free again without touching any of them. Blocks
+    // covering the reserve are kept and go back on the free list one block at
+    // a time as Pop runs dry; the rest and the old free list are left for
+    // Release.
+    void Reset ()
+    {
+        size_t kept = 0;
+        int capacity = 0;
+        while (kept < m_kBlocks.size () && capacity < m_nReserve) {
+            capacity += m_kBlocks[kept++].m_nSize;
         }
-        else if (m_pkRoot != nullptr && m_pkRoot->m_nScore < _nScore) {
-            InsertRoot (_nID, _nScore);
+
+        m_nKept = kept;
+        m_nFilled = 0;
+        m_nCapacity = 0;
+
+        m_kFree.clear ();
+
+        if (m_kStale.empty ()) {
+            m_kStale.swap (m_kChunks);
         }
         else
         {
-            std::vector<TRankNode*> parents;
-            int size = std::max (m_pkRoot->m_nLevel - 1, 0);
-            parents.reserve (size);
-
-            TRankNode* node = FindPrevNode (_nScore, parents);
-            if (node == nullptr) {
-                return;
+            for (auto& chunk : m_kChunks) {
+                m_kStale.emplace_back (std::move (chunk));
             }
 
-            TRankNode* newNode = InsertNext (node, _nID, _nScore);
-            if (newNode == nullptr) {
-                return;
-            }
+            m_kChunks.clear ();
+        }
+    }
 
-            TRankNode* topNode = newNode;
-            for (auto it = parents.rbegin (); it != parents.rend (); it++)
-            {
-                TRankNode* parent = *it;
-                if (parent == nullptr) {
-                    break;
-                }
+    // True from Reset until the free list is used again.
+    bool IsReset () const
+    {
+        return m_nFilled == 0 && m_kFree.empty () && m_kChunks.empty ();
+    }
 
-                parent->m_nCount++;
+    bool IsReleasing () const
+    {
+        return m_kBlocks.size () > std::max (m_nKept, m_nFilled) || !m_kStale.empty ();
+    }
 
-                if (parent->m_pkDown != nullptr)
-                {
-                    if (parent->m_nCount > pow (N, parent->m_nLevel - 1)) {
-                        topNode = InsertUp (topNode, parent);
-                    }
-                }
-            }
+    // Frees up to _nSteps blocks past the reserve and as many chunks of the
+    // old free list. Returns true while some are left.
+    bool Release (int _nSteps)
+    {
+        for (int steps = _nSteps; steps > 0 && m_kBlocks.size () > std::max (m_nKept, m_nFilled); steps--)
+        {
+            FreeBlock (m_kBlocks.back ());
+            m_kBlocks.pop_back ();
+        }
 
-            if (CalcCount (m_pkRoot) > pow (N, m_pkRoot->m_nLevel)) {
-                IncreaseLevel ();
-            }
+        for (int steps = _nSteps; steps > 0 && !m_kStale.empty (); steps--) {
+            m_kStale.pop_back ();
+        }
+
+        if (m_kBlocks.empty ()) {
+            m_kBlocks.shrink_to_fit ();
+        }
+
+        if (m_kStale.empty ()) {
+            m_kStale.shrink_to_fit ();
         }
+
+        return IsReleasing ();
     }
 
-    void RemoveRank (TID _nID)
+    void Clear ()
     {
-        if (m_pkRoot != nullptr && m_pkRoot->m_nID == _nID) {
-            RemoveRoot ();
-        }
-        else {
-            RemoveNode (GetMapNode (_nID));
+        for (auto& block : m_kBlocks) {
+            FreeBlock (block);
         }
 
-        RemoveMapNode (_nID);
+        m_kBlocks.clear ();
+        m_kBlocks.shrink_to_fit ();
+
+        m_kFree.clear ();
+        m_kFree.shrink_to_fit ();
+
+        m_kSpare.clear ();
+        m_kSpare.shrink_to_fit ();
+
+        m_kChunks.clear ();
+        m_kChunks.shrink_to_fit ();
+
+        m_kStale.clear ();
+        m_kStale.shrink_to_fit ();
+
+        m_nCapacity = 0;
+        m_nFilled = 0;
+        m_nKept = 0;
     }
 
-    void GetRankList (std::vector<std::pair<TID, TScore>>& _rkRankList)
+    void Swap (CRankArena& _rkArena)
     {
-        _rkRankList.clear ();
+        std::swap (m_nCapacity, _rkArena.m_nCapacity);
+        std::swap (m_nReserve, _rkArena.m_nReserve);
+        std::swap (m_bHugePages, _rkArena.m_bHugePages);
+        std::swap (m_nNumaNode, _rkArena.m_nNumaNode);
+        std::swap (m_nFilled, _rkArena.m_nFilled);
+        std::swap (m_nKept, _rkArena.m_nKept);
+
+        m_kBlocks.swap (_rkArena.m_kBlocks);
+        m_kFree.swap (_rkArena.m_kFree);
+        m_kSpare.swap (_rkArena.m_kSpare);
+        m_kChunks.swap (_rkArena.m_kChunks);
+        m_kStale.swap (_rkArena.m_kStale);
+    }
 
-        int count = CalcCount (m_pkRoot);
-        if (count < 1) {
-            return;
+private:
+    // The free list is kept in chunks of FreeChunkSize so Release can hand
+    // a large one back a piece at a time. A drained chunk is held as the
+    // spare, so pushes and pops around a chunk boundary do not allocate.
+    void PushChunk ()
+    {
+        m_kChunks.emplace_back (std::move (m_kFree));
+        m_kFree.swap (m_kSpare);
+
+        if (m_kFree.capacity () == 0 && !m_kStale.empty ())
+        {
+            m_kFree.swap (m_kStale.back ());
+            m_kStale.pop_back ();
         }
 
-        _rkRankList.reserve (count);
+        m_kFree.clear ();
+        m_kFree.reserve (FreeChunkSize);
+    }
 
-        TRankNode* node = GetBottomNode (m_pkRoot);
-        while (node != nullptr)
+    void Refill ()
+    {
+        if (!m_kChunks.empty ())
         {
-            _rkRankList.emplace_back (node->m_nID, node->m_nScore);
-            node = node->m_pkNext;
+            m_kSpare.swap (m_kFree);
+            m_kFree.swap (m_kChunks.back ());
+            m_kChunks.pop_back ();
+        }
+        else if (m_nFilled < m_kBlocks.size ()) {
+            Fill (m_kBlocks[m_nFilled++]);
+        }
+        else {
+            Grow ();
         }
     }
 
-    void GetRankList (int _nRank, int _nSize, std::vector<std::pair<TID, TScore>>& _rkRankList)
+    void Fill (const CRankBlock& _rkBlock)
     {
-        _rkRankList.clear ();
+        for (int i = _rkBlock.m_nSize - 1; i >= 0; i--) {
+            Push (_rkBlock.m_pkObjects + i);
+        }
 
-        int maxSize = CalcCount (m_pkRoot);
-        if (_nRank < 1 || _nRank > maxSize) {
-            return;
+        m_nCapacity += _rkBlock.m_nSize;
+    }
+
+private:
+    // Constructing every object here also first-touches the block's pages
+    // on the calling thread.
+    void Grow ()
+    {
+        int size = m_kBlocks.empty () ? MinBlockSize : std::min (m_kBlocks.back ().m_nSize * 2, static_cast<int> (MaxBlockSize));
+        bool isPaged = m_bHugePages || m_nNumaNode >= 0;
+
+        T* block = nullptr;
+        if (m_bHugePages)
+        {
+            size = static_cast<int> (CRankMemory::GetPageBytes (sizeof (T) * size) / sizeof (T));
+            block = static_cast<T*> (CRankMemory::AllocatePages (sizeof (T) * size, true, m_nNumaNode));
+        }
+        else if (isPaged)
+        {
+            size = static_cast<int> (CRankMemory::GetNodePageBytes (sizeof (T) * size) / sizeof (T));
+            block = static_cast<T*> (CRankMemory::AllocateNodePages (sizeof (T) * size, m_nNumaNode));
+        }
+        else {
+            block = static_cast<T*> (::operator new (sizeof (T) * size));
         }
 
-        int count = std::min (_nSize, maxSize - _nRank + 1);
-        _rkRankList.reserve (count);
+        for (int i = 0; i < size; i++) {
+            new (block + i) T ();
+        }
 
-        TRankNode* result = QueryRank (_nRank);
-        if (result == nullptr) {
-            return;
+        m_kBlocks.emplace_back (block, size, isPaged, m_bHugePages);
+        m_nFilled = m_kBlocks.size ();
+
+        Fill (m_kBlocks.back ());
+    }
+
+    void FreeBlock (CRankBlock& _rkBlock)
+    {
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            for (int i = 0; i < _rkBlock.m_nSize; i++) {
+                _rkBlock.m_pkObjects[i].~T ();
+            }
         }
 
-        TRankNode* node = GetBottomNode (result);
-        while (node != nullptr && count > 0)
+        if (_rkBlock.m_bHugePages) {
+            CRankMemory::FreePages (_rkBlock.m_pkObjects, sizeof (T) * _rkBlock.m_nSize);
+        }
+        else if (_rkBlock.m_bPaged) {
+            CRankMemory::FreeNodePages (_rkBlock.m_pkObjects, sizeof (T) * _rkBlock.m_nSize);
+        }
+        else {
+            ::operator delete (_rkBlock.m_pkObjects);
+        }
+    }
+
+private:
+    int m_nCapacity;
+    int m_nReserve;
+    bool m_bHugePages;
+    int m_nNumaNode;
+    std::vector<CRankBlock> m_kBlocks;
+    size_t m_nFilled;
+    size_t m_nKept;
+    std::vector<T*> m_kFree;
+    std::vector<T*> m_kSpare;
+    std::vector<std::vector<T*>> m_kChunks;
+    std::vector<std::vector<T*>> m_kStale;
+};
+
+// Memory behind the ID maps of the lists on one pool. Single map nodes come
+// from an arena, so a retired map gives its nodes back to the arena rather
+// than to malloc one by one. Larger allocations, the bucket arrays, are kept
+// as runs; a freed run is handed back by Release one page chunk per step, so
+// a large bucket array is never one long unmap.
+template<typename TSlot>
+class CRankMapStorage
+{
+public:
+    class CRankRun
+    {
+    public:
+        CRankRun (void* _pkBytes, size_t _nBytes)
+            : m_pkBytes (_pkBytes)
+            , m_nBytes (_nBytes)
+            , m_nFreed (0)
         {
-            _rkRankList.emplace_back (node->m_nID, node->m_nScore);
-            node = node->m_pkNext;
-            count--;
         }
+
+        void* m_pkBytes;
+        size_t m_nBytes;
+        size_t m_nFreed;
+    };
+
+public:
+    CRankMapStorage ()
+    {
     }
 
-    void Clear ()
+    CRankMapStorage (const CRankMapStorage&) = delete;
+
+    virtual ~CRankMapStorage ()
     {
-        ClearList ();
-        ClearPool ();
+        Clear ();
     }
 
-    void Swap (CRankList& _rkRankList)
+    TSlot* PopSlot ()
     {
-        std::swap (m_pkRoot, _rkRankList.m_pkRoot);
+        return m_kSlots.Pop ();
+    }
 
-        m_kNodeMap.swap (_rkRankList.m_kNodeMap);
-        m_kPool.swap (_rkRankList.m_kPool);
+    void PushSlot (TSlot* _pkSlot)
+    {
+        m_kSlots.Push (_pkSlot);
     }
 
-    // DEBUG
-    void Print ()
+    void* AllocateRun (size_t _nBytes, bool _bHugePages, int _nNumaNode)
     {
-        TRankNode* node = m_pkRoot;
-        while (node != nullptr)
-        {
-            TRankNode* down = node->m_pkDown;
-            while (node != nullptr)
-            {
-                TRankNode* next = node->m_pkNext;
-                std::cout << "level: " << node->m_nLevel << ", count: " << node->m_nCount << ", id:" << node->m_nID << ", score: " << node->m_nScore << std::endl;
-                node = next;
-            }
+        // Room on both lists first, so FreeRun and Drop never allocate.
+        m_kRuns.reserve (m_kRuns.size () + 1);
+        m_kStale.reserve (m_kStale.size () + m_kRuns.size () + 1);
 
-            node = down;
-        }
+        void* bytes = CRankPageAllocator<unsigned char> (_bHugePages, _nNumaNode).allocate (_nBytes);
+        m_kRuns.emplace_back (bytes, _nBytes);
+
+        return bytes;
     }
 
-    void CheckScore ()
+    void FreeRun (void* _pkBytes)
+    {
+        for (size_t i = m_kRuns.size (); i > 0; i--)
+        {
+            if (m_kRuns[i - 1].m_pkBytes == _pkBytes)
+            {
+                m_kStale.emplace_back (m_kRuns[i - 1]);
+
+                m_kRuns[i - 1] = m_kRuns.back ();
+                m_kRuns.pop_back ();
+                return;
+            }
+        }
+    }
+
+    // Gives up the runs of every map at once, for a list that drops its maps
+    // without destroying them; their nodes go with the next Reset.
+    void Drop ()
+    {
+        m_kStale.insert (m_kStale.end (), m_kRuns.begin (), m_kRuns.end ());
+        m_kRuns.clear ();
+    }
+
+    int GetLiveCount () const
+    {
+        return m_kSlots.GetLiveCount ();
+    }
+
+    void SetReserve (int _nReserve)
+    {
+        m_kSlots.SetReserve (_nReserve);
+    }
+
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        m_kSlots.SetPlacement (_bHugePages, _nNumaNode);
+    }
+
+    void Reset ()
+    {
+        m_kSlots.Reset ();
+    }
+
+    bool IsReset () const
+    {
+        return m_kSlots.IsReset ();
+    }
+
+    bool IsReleasing () const
+    {
+        return m_kSlots.IsReleasing () || !m_kStale.empty ();
+    }
+
+    // Frees up to _nSteps slot blocks and _nSteps chunks of freed runs, a
+    // chunk being a huge page worth of a paged run or a whole heap run.
+    bool Release (int _nSteps)
+    {
+        m_kSlots.Release (_nSteps);
+
+        for (int steps = _nSteps; steps > 0 && !m_kStale.empty (); steps--)
+        {
+            CRankRun& run = m_kStale.back ();
+            if (run.m_nBytes < CRankMemory::HugePageSize) {
+                ::operator delete (run.m_pkBytes);
+            }
+            else if (!CRankMemory::FreePagesStep (run.m_pkBytes, run.m_nBytes, run.m_nFreed, CRankMemory::HugePageSize)) {
+                continue;
+            }
+
+            m_kStale.pop_back ();
+        }
+
+        return IsReleasing ();
+    }
+
+    // Runs still held by a map are left to it.
+    void Clear ()
+    {
+        m_kSlots.Clear ();
+
+        Release (INT_MAX);
+
+        if (m_kRuns.empty ()) {
+            m_kStale.shrink_to_fit ();
+        }
+    }
+
+    void Swap (CRankMapStorage& _rkStorage)
+    {
+        m_kSlots.Swap (_rkStorage.m_kSlots);
+        m_kRuns.swap (_rkStorage.m_kRuns);
+        m_kStale.swap (_rkStorage.m_kStale);
+    }
+
+private:
+    CRankArena<TSlot> m_kSlots;
+    std::vector<CRankRun> m_kRuns;
+    std::vector<CRankRun> m_kStale;
+};
+
+// Takes single map nodes from a CRankMapStorage slot and every larger
+// allocation from its runs. Every single object the map allocates lands in
+// the slot arena, which with some standard libraries includes a sentinel
+// node that lives as long as the map, so the arena must not be reset under a
+// live map. Without a storage it is a CRankPageAllocator.
+template<typename T, typename TSlot>
+class CRankMapAllocator : public CRankPageAllocator<T>
+{
+public:
+    template<typename U>
+    struct rebind
+    {
+        using other = CRankMapAllocator<U, TSlot>;
+    };
+
+public:
+    CRankMapAllocator ()
+        : m_pkStorage (nullptr)
+    {
+    }
+
+    CRankMapAllocator (bool _bHugePages, int _nNumaNode, CRankMapStorage<TSlot>* _pkStorage)
+        : CRankPageAllocator<T> (_bHugePages, _nNumaNode)
+        , m_pkStorage (_pkStorage)
+    {
+    }
+
+    template<typename U>
+    CRankMapAllocator (const CRankMapAllocator<U, TSlot>& _rkAllocator)
+        : CRankPageAllocator<T> (_rkAllocator)
+        , m_pkStorage (_rkAllocator.m_pkStorage)
+    {
+    }
+
+    T* allocate (size_t _nSize)
+    {
+        if (m_pkStorage == nullptr) {
+            return CRankPageAllocator<T>::allocate (_nSize);
+        }
+
+        if (IsSlot (_nSize)) {
+            return reinterpret_cast<T*> (m_pkStorage->PopSlot ());
+        }
+
+        return static_cast<T*> (m_pkStorage->AllocateRun (_nSize * sizeof (T), this->m_bHugePages, this->m_nNumaNode));
+    }
+
+    void deallocate (T* _pkObjects, size_t _nSize)
+    {
+        if (m_pkStorage == nullptr) {
+            CRankPageAllocator<T>::deallocate (_pkObjects, _nSize);
+        }
+        else if (IsSlot (_nSize)) {
+            m_pkStorage->PushSlot (reinterpret_cast<TSlot*> (_pkObjects));
+        }
+        else {
+            m_pkStorage->FreeRun (_pkObjects);
+        }
+    }
+
+    template<typename U>
+    bool operator== (const CRankMapAllocator<U, TSlot>& _rkAllocator) const
+    {
+        return m_pkStorage == _rkAllocator.m_pkStorage;
+    }
+
+    CRankMapStorage<TSlot>* m_pkStorage;
+
+private:
+    static bool IsSlot (size_t _nSize)
+    {
+        return _nSize == 1 && sizeof (T) <= sizeof (TSlot) && alignof (T) <= alignof (TSlot);
+    }
+};
+
+template<typename TID, typename TScore>
+class CRankPool
+{
+public:
+    using TRankEntry = CRankEntry<TID, TScore>;
+    using TRankNode = CRankNode<TID, TScore>;
+    using TMapSlot = CRankMapSlot<TID, TScore>;
+
+public:
+    CRankPool ()
+        : m_bHugePages (false)
+        , m_nNumaNode (-1)
+        , m_nUpperLevel (0)
+    {
+    }
+
+    CRankPool (const CRankPool&) = delete;
+
+    virtual ~CRankPool ()
+    {
+        Clear ();
+    }
+
+    TRankNode* PopNode (int _nLevel, int _nCount, TRankEntry* _pkEntry)
+    {
+        TRankNode* node = GetNodes (_nLevel).Pop ();
+
+        node->m_nLevel = _nLevel;
+        node->m_nCount = _nCount;
+        node->m_pkEntry = _pkEntry;
+        if constexpr (TRankNode::IsCached) {
+            node->m_nKey = _pkEntry->m_nScore;
+        }
+        node->m_pkUp = nullptr;
+        node->m_pkDown = nullptr;
+        node->m_pkPrev = nullptr;
+        node->m_pkNext = nullptr;
+
+        return node;
+    }
+
+    void PushNode (TRankNode* _pkNode)
+    {
+        if (_pkNode == nullptr) {
+            return;
+        }
+
+        GetNodes (_pkNode->m_nLevel).Push (_pkNode);
+    }
+
+    TRankEntry* PopEntry (TID _nID, TScore _nScore)
+    {
+        TRankEntry* entry = m_kEntries.Pop ();
+
+        entry->m_nID = std::move (_nID);
+        entry->m_nScore = std::move (_nScore);
+
+        return entry;
+    }
+
+    void PushEntry (TRankEntry* _pkEntry)
+    {
+        m_kEntries.Push (_pkEntry);
+    }
+
+    int GetLiveCount () const
+    {
+        return m_kNodes.GetLiveCount () + m_kUpperNodes.GetLiveCount () + m_kEntries.GetLiveCount () + m_kMapStorage.GetLiveCount ();
+    }
+
+    CRankMapStorage<TMapSlot>* GetMapStorage ()
+    {
+        return &m_kMapStorage;
+    }
+
+    // Reserve is counted in entries; towers need about N / (N - 1) nodes per
+    // entry, so the node arena keeps half as many again. Map slots are one
+    // per entry.
+    void SetReserve (int _nReserve)
+    {
+        m_kNodes.SetReserve (_nReserve + _nReserve / 2);
+        m_kEntries.SetReserve (_nReserve);
+        m_kMapStorage.SetReserve (_nReserve);
+    }
+
+    bool IsHugePages () const
+    {
+        return m_bHugePages;
+    }
+
+    int GetNumaNode () const
+    {
+        return m_nNumaNode;
+    }
+
+    int GetUpperLevel () const
+    {
+        return m_nUpperLevel;
+    }
+
+    // Blocks allocated from now on use 2 MB pages if _bHugePages and prefer
+    // NUMA node _nNumaNode, or first touch for -1.
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        m_bHugePages = _bHugePages;
+        m_nNumaNode = std::max (_nNumaNode, -1);
+
+        m_kNodes.SetPlacement (m_bHugePages, m_nNumaNode);
+        m_kUpperNodes.SetPlacement (m_bHugePages, m_nNumaNode);
+        m_kEntries.SetPlacement (m_bHugePages, m_nNumaNode);
+        m_kMapStorage.SetPlacement (m_bHugePages, m_nNumaNode);
+    }
+
+    // Nodes at _nUpperLevel and above come from their own arena, so the few
+    // nodes every query walks through share a handful of pages instead of
+    // being spread over the whole list. 0 turns it off. Nodes go back to the
+    // arena their level maps to when pushed; the arenas only have to agree
+    // in total, which Reset restores.
+    void SetUpperLevel (int _nUpperLevel)
+    {
+        m_nUpperLevel = std::max (_nUpperLevel, 0);
+    }
+
+    // Only while nothing popped from the arenas is in use, a map's nodes
+    // included.
+    void Reset ()
+    {
+        m_kNodes.Reset ();
+        m_kUpperNodes.Reset ();
+        m_kEntries.Reset ();
+        m_kMapStorage.Reset ();
+    }
+
+    bool IsReset () const
+    {
+        return m_kNodes.IsReset () && m_kUpperNodes.IsReset () && m_kEntries.IsReset () && m_kMapStorage.IsReset ();
+    }
+
+    bool IsReleasing () const
+    {
+        return m_kNodes.IsReleasing () || m_kUpperNodes.IsReleasing () || m_kEntries.IsReleasing () || m_kMapStorage.IsReleasing ();
+    }
+
+    bool Release (int _nSteps)
+    {
+        bool isReleasing = m_kNodes.Release (_nSteps);
+        isReleasing |= m_kUpperNodes.Release (_nSteps);
+        isReleasing |= m_kEntries.Release (_nSteps);
+        isReleasing |= m_kMapStorage.Release (_nSteps);
+
+        return isReleasing;
+    }
+
+    void Clear ()
+    {
+        m_kNodes.Clear ();
+        m_kUpperNodes.Clear ();
+        m_kEntries.Clear ();
+        m_kMapStorage.Clear ();
+    }
+
+    void Swap (CRankPool& _rkPool)
+    {
+        std::swap (m_bHugePages, _rkPool.m_bHugePages);
+        std::swap (m_nNumaNode, _rkPool.m_nNumaNode);
+        std::swap (m_nUpperLevel, _rkPool.m_nUpperLevel);
+
+        m_kNodes.Swap (_rkPool.m_kNodes);
+        m_kUpperNodes.Swap (_rkPool.m_kUpperNodes);
+        m_kEntries.Swap (_rkPool.m_kEntries);
+        m_kMapStorage.Swap (_rkPool.m_kMapStorage);
+    }
+
+private:
+    CRankArena<TRankNode>& GetNodes (int _nLevel)
+    {
+        if (m_nUpperLevel > 0 && _nLevel >= m_nUpperLevel) {
+            return m_kUpperNodes;
+        }
+
+        return m_kNodes;
+    }
+
+private:
+    bool m_bHugePages;
+    int m_nNumaNode;
+    int m_nUpperLevel;
+
+    CRankArena<TRankNode> m_kNodes;
+    CRankArena<TRankNode> m_kUpperNodes;
+    CRankArena<TRankEntry> m_kEntries;
+    CRankMapStorage<TMapSlot> m_kMapStorage;
+};
+
+// One of the read counters of a list, on its own cache line.
+class CRankReadCount
+{
+public:
+    CRankReadCount ()
+        : m_nReads (0)
+    {
+    }
+
+    alignas (64) std::atomic<uint64_t> m_nReads;
+};
+
+template<RankID TID, RankScore TScore, int N = 4>
+class CRankList
+{
+public:
+    using TRankEntry = CRankEntry<TID, TScore>;
+    using TRankNode = CRankNode<TID, TScore>;
+    using TRankPool = CRankPool<TID, TScore>;
+    using TRankEvent = CRankEvent<TID, TScore>;
+    using TRankEventSink = CRankEventSink<TID, TScore>;
+    using TNodeMap = std::unordered_map<TID, TRankNode*, std::hash<TID>, std::equal_to<TID>, CRankMapAllocator<std::pair<const TID, TRankNode*>, CRankMapSlot<TID, TScore>>>;
+
+    static constexpr int BatchSize = 16;
+    static constexpr int ReclaimSteps = 64;
+    static constexpr int RebuildSteps = 64;
+    static constexpr int MinFanout = 2;
+    static constexpr int MaxFanout = 64;
+    static constexpr uint64_t TuneInterval = 1 << 16;
+    static constexpr int ReadStripes = 16;
+    static constexpr int MaxLevel = 64;
+
+public:
+    CRankList ()
+        : m_pkRoot (nullptr)
+        , m_pkNodeMap (nullptr)
+        , m_nFanout (N)
+        , m_pkLevelSizes (nullptr)
+        , m_bAutoTune (false)
+        , m_pkReads (nullptr)
+        , m_nWrites (0)
+        , m_bReshape (false)
+        , m_pkShadow (nullptr)
+        , m_bRebuilding (false)
+        , m_nRebuildCursor (0)
+        , m_pkEventSink (nullptr)
+        , m_pkOwnedPool (new TRankPool ())
+        , m_pkPool (m_pkOwnedPool)
+    {
+        SetLevelSizes ();
+    }
+
+    explicit CRankList (TRankPool* _pkPool)
+        : m_pkRoot (nullptr)
+        , m_pkNodeMap (nullptr)
+        , m_nFanout (N)
+        , m_pkLevelSizes (nullptr)
+        , m_bAutoTune (false)
+        , m_pkReads (nullptr)
+        , m_nWrites (0)
+        , m_bReshape (false)
+        , m_pkShadow (nullptr)
+        , m_bRebuilding (false)
+        , m_nRebuildCursor (0)
+        , m_pkEventSink (nullptr)
+        , m_pkOwnedPool (_pkPool == nullptr ? new TRankPool () : nullptr)
+        , m_pkPool (_pkPool != nullptr ? _pkPool : m_pkOwnedPool)
+    {
+        SetLevelSizes ();
+    }
+
+    CRankList (const CRankList&) = delete;
+
+    virtual ~CRankList ()
+    {
+        m_pkEventSink = nullptr;
+
+        Clear ();
+
+        delete[] m_pkReads;
+        delete m_pkOwnedPool;
+    }
+
+    TScore GetScore (TID _nID)
+    {
+        CountReads (1);
+
+        TRankNode* mapNode = GetMapNode (_nID);
+        if (mapNode == nullptr) {
+            return TScore ();
+        }
+
+        return mapNode->m_pkEntry->m_nScore;
+    }
+
+    int GetRank (TID _nID)
+    {
+        CountReads (1);
+
+        TRankNode* mapNode = GetMapNode (_nID);
+        if (mapNode == nullptr) {
+            return 0;
+        }
+
+        return CalcRank (mapNode) + 1;
+    }
+
+    // Same results as calling GetRank and GetScore for each ID, but works on
+    // up to BatchSize IDs at once. Each slot moves one stage per round and
+    // prefetches what its next stage reads: the map lookup prefetches the
+    // tower top, the tower top prefetches the entry and the first step of the
+    // walk, and each step prefetches the next node. The cache misses of
+    // different IDs then overlap instead of running serially. The score is
+    // read from the entry once the walk ends.
+    void GetRanks (std::span<const TID> _kIDs, std::vector<std::pair<int, TScore>>& _rkRanks)
+    {
+        size_t size = _kIDs.size ();
+
+        CountReads (size);
+
+        _rkRanks.clear ();
+        _rkRanks.resize (size, std::make_pair (0, TScore ()));
+
+        TRankNode* nodes[BatchSize] = {};
+        TRankEntry* entries[BatchSize] = {};
+        int counts[BatchSize] = {};
+        bool pendings[BatchSize] = {};
+        size_t slots[BatchSize] = {};
+
+        size_t next = 0;
+        int active = 0;
+
+        while (active > 0 || next < size)
+        {
+            // Lookups for every free slot go first and back to back; they do
+            // not depend on each other, so their misses can overlap too.
+            for (int i = 0; i < BatchSize && next < size; i++)
+            {
+                if (nodes[i] != nullptr) {
+                    continue;
+                }
+
+                while (next < size)
+                {
+                    size_t slot = next++;
+
+                    TRankNode* mapNode = GetMapNode (_kIDs[slot]);
+                    if (mapNode != nullptr)
+                    {
+                        nodes[i] = mapNode;
+                        entries[i] = nullptr;
+                        counts[i] = 0;
+                        pendings[i] = false;
+                        slots[i] = slot;
+
+                        Prefetch (mapNode);
+
+                        active++;
+                        break;
+                    }
+                }
+            }
+
+            for (int i = 0; i < BatchSize; i++)
+            {
+                TRankNode* node = nodes[i];
+                if (node == nullptr) {
+                    continue;
+                }
+
+                if (entries[i] == nullptr)
+                {
+                    entries[i] = node->m_pkEntry;
+
+                    Prefetch (entries[i]);
+                    Prefetch (node->m_pkUp != nullptr ? node->m_pkUp : node->m_pkPrev);
+                    continue;
+                }
+
+                if (pendings[i]) {
+                    counts[i] += node->m_nCount;
+                }
+
+                if (node->m_pkUp != nullptr)
+                {
+                    nodes[i] = node->m_pkUp;
+                    pendings[i] = false;
+                }
+                else if (node->m_pkPrev != nullptr)
+                {
+                    nodes[i] = node->m_pkPrev;
+                    pendings[i] = true;
+                }
+                else
+                {
+                    _rkRanks[slots[i]].first = counts[i] + 1;
+                    _rkRanks[slots[i]].second = entries[i]->m_nScore;
+
+                    nodes[i] = nullptr;
+                    active--;
+                    continue;
+                }
+
+                Prefetch (nodes[i]);
+            }
+        }
+    }
+
+    void SetRank (TID _nID, TScore _nScore)
+    {
+        Maintain ();
+
+        if (!m_bRebuilding && !IsNotifying ())
+        {
+            UpdateRank (std::move (_nID), std::move (_nScore));
+            return;
+        }
+
+        TRankNode* mapNode = GetMapNode (_nID);
+        if (mapNode != nullptr && GetNodeScore (mapNode) == _nScore) {
+            return;
+        }
+
+        int rank = mapNode != nullptr ? CalcRank (mapNode) + 1 : 0;
+        UpdateRank (_nID, std::move (_nScore));
+
+        if (IsNotifying ()) {
+            NotifyWindows (_nID, rank);
+        }
+
+        if (m_bRebuilding) {
+            TrackRebuild (_nID, rank);
+        }
+    }
+
+    void RemoveRank (TID _nID)
+    {
+        Maintain ();
+
+        if (!m_bRebuilding && !IsNotifying ())
+        {
+            EraseRank (_nID);
+            return;
+        }
+
+        int rank = FindRank (_nID);
+        EraseRank (_nID);
+
+        if (IsNotifying ()) {
+            NotifyWindows (_nID, rank);
+        }
+
+        if (m_bRebuilding) {
+            TrackRebuild (_nID, rank);
+        }
+    }
+
+    void GetRankList (std::vector<std::pair<TID, TScore>>& _rkRankList)
+    {
+        CountReads (1);
+
+        _rkRankList.clear ();
+
+        int count = CalcCount (m_pkRoot);
+        if (count < 1) {
+            return;
+        }
+
+        _rkRankList.reserve (count);
+
+        TRankNode* node = GetBottomNode (m_pkRoot);
+        while (node != nullptr)
+        {
+            _rkRankList.emplace_back (node->m_pkEntry->m_nID, node->m_pkEntry->m_nScore);
+            node = node->m_pkNext;
+        }
+    }
+
+    void GetRankList (int _nRank, int _nSize, std::vector<std::pair<TID, TScore>>& _rkRankList)
+    {
+        CountReads (1);
+
+        _rkRankList.clear ();
+
+        int maxSize = CalcCount (m_pkRoot);
+        if (_nRank < 1 || _nRank > maxSize) {
+            return;
+        }
+
+        int count = std::min (_nSize, maxSize - _nRank + 1);
+        _rkRankList.reserve (count);
+
+        TRankNode* result = QueryRank (_nRank);
+        if (result == nullptr) {
+            return;
+        }
+
+        TRankNode* node = GetBottomNode (result);
+        while (node != nullptr && count > 0)
+        {
+            _rkRankList.emplace_back (node->m_pkEntry->m_nID, node->m_pkEntry->m_nScore);
+            node = node->m_pkNext;
+            count--;
+        }
+    }
+
+    void Clear ()
+    {
+        ClearShadow ();
+        ClearList ();
+        ClearPool ();
+
+        NotifyReset ();
+    }
+
+    // Detaches the current entries in O(1) and leaves an empty list. The old
+    // nodes and map entries are given back ReclaimSteps at a time by later
+    // SetRank/RemoveRank calls, or by calling Reclaim directly.
+    void ClearIncremental ()
+    {
+        if (m_bRebuilding)
+        {
+            m_pkShadow->ClearIncremental ();
+            m_bRebuilding = false;
+        }
+
+        if (m_pkRoot != nullptr)
+        {
+            m_kRetired.emplace_back (m_pkRoot);
+            m_pkRoot = nullptr;
+        }
+
+        if (m_pkNodeMap != nullptr)
+        {
+            m_kRetiredMaps.emplace_back (m_pkNodeMap);
+            m_pkNodeMap = nullptr;
+        }
+
+        NotifyReset ();
+    }
+
+    bool IsReclaiming () const
+    {
+        return !m_kRetired.empty () || !m_kRetiredMaps.empty () || m_pkPool->IsReleasing () || (m_pkShadow != nullptr && !m_bRebuilding);
+    }
+
+    // Returns true while retired work is left. A finished or aborted rebuild
+    // leaves the old structure in the shadow list, which drains here too.
+    bool Reclaim (int _nSteps)
+    {
+        if (m_pkShadow != nullptr && !m_bRebuilding)
+        {
+            if (!m_pkShadow->Reclaim (_nSteps)) {
+                ClearShadow ();
+            }
+        }
+
+        int steps = _nSteps;
+        while (steps > 0 && !m_kRetired.empty ())
+        {
+            TRankNode* node = m_kRetired.back ();
+            m_kRetired.pop_back ();
+
+            if (node->m_pkPrev == nullptr && node->m_pkDown != nullptr) {
+                m_kRetired.emplace_back (node->m_pkDown);
+            }
+
+            if (node->m_pkNext != nullptr) {
+                m_kRetired.emplace_back (node->m_pkNext);
+            }
+
+            if (node->m_pkDown == nullptr) {
+                m_pkPool->PushEntry (node->m_pkEntry);
+            }
+
+            PushNode (node);
+            steps--;
+        }
+
+        steps = _nSteps;
+        while (steps > 0 && !m_kRetiredMaps.empty ())
+        {
+            TNodeMap* retiredMap = m_kRetiredMaps.back ();
+            while (steps > 0 && !retiredMap->empty ())
+            {
+                retiredMap->erase (retiredMap->begin ());
+                steps--;
+            }
+
+            // Rehashing the drained map swaps its bucket array for a tiny one
+            // and hands the old one to the pool's Release, instead of
+            // clearing and unmapping all of it in this step.
+            if (retiredMap->empty ())
+            {
+                retiredMap->rehash (0);
+                delete retiredMap;
+                m_kRetiredMaps.pop_back ();
+            }
+        }
+
+        // A shared pool is never reset by its lists, so releasing one only
+        // hands back the bucket arrays its maps have freed.
+        if (m_kRetired.empty () && m_kRetiredMaps.empty ())
+        {
+            // A live map holds arena objects, so with none left live the
+            // pool can be reset without pulling memory from under one.
+            if (m_pkOwnedPool != nullptr && !m_pkOwnedPool->IsReleasing () && !m_pkOwnedPool->IsReset () && m_pkOwnedPool->GetLiveCount () == 0) {
+                m_pkOwnedPool->Reset ();
+            }
+
+            m_pkPool->Release (1);
+        }
+
+        return IsReclaiming ();
+    }
+
+    // Number of free nodes the owned pool keeps warm across Clear.
+    void SetPoolReserve (int _nReserve)
+    {
+        m_pkPool->SetReserve (_nReserve);
+    }
+
+    // Node storage and the ID index use 2 MB pages if _bHugePages and prefer
+    // NUMA node _nNumaNode, or the node of the writing thread for -1. Affects
+    // the pool's future blocks and rehashes the index; set it before the list
+    // grows.
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        m_pkPool->SetPlacement (_bHugePages, _nNumaNode);
+        SetMapPlacement ();
+    }
+
+    // Keeps nodes at _nUpperLevel and above in a separate arena, see
+    // CRankPool::SetUpperLevel.
+    void SetUpperLevel (int _nUpperLevel)
+    {
+        m_pkPool->SetUpperLevel (_nUpperLevel);
+    }
+
+    // Events for subscribed windows go to _pkEventSink, which is called on
+    // the writing thread. Writes only do the rank lookups events need while
+    // a sink is set and a window is subscribed.
+    void SetEventSink (TRankEventSink* _pkEventSink)
+    {
+        m_pkEventSink = _pkEventSink;
+    }
+
+    // Watches ranks _nRank to _nRank + _nSize - 1. A write emits an event per
+    // window it changes: Move when the ID stays inside, Enter/Leave for the
+    // ID and for the entry it pushes across an edge of the window. Returns
+    // the window passed back in each event.
+    int Subscribe (int _nRank, int _nSize)
+    {
+        std::pair<int, int> window (std::max (_nRank, 1), std::max (_nSize, 1));
+
+        for (size_t i = 0; i < m_kWindows.size (); i++)
+        {
+            if (m_kWindows[i].second == 0)
+            {
+                m_kWindows[i] = window;
+                return static_cast<int> (i);
+            }
+        }
+
+        m_kWindows.emplace_back (window);
+
+        return static_cast<int> (m_kWindows.size ()) - 1;
+    }
+
+    void Unsubscribe (int _nWindow)
+    {
+        if (_nWindow < 0 || _nWindow >= static_cast<int> (m_kWindows.size ())) {
+            return;
+        }
+
+        m_kWindows[_nWindow] = std::make_pair (0, 0);
+
+        while (!m_kWindows.empty () && m_kWindows.back ().second == 0) {
+            m_kWindows.pop_back ();
+        }
+    }
+
+    // Fanout used by later splits and merges. The existing shape is kept
+    // until a rebuild, which is started here as soon as none is running.
+    void SetFanout (int _nFanout)
+    {
+        int fanout = std::clamp (_nFanout, static_cast<int> (MinFanout), static_cast<int> (MaxFanout));
+        if (fanout == m_nFanout) {
+            return;
+        }
+
+        m_nFanout = fanout;
+        SetLevelSizes ();
+
+        m_bReshape = !StartRebuild ();
+    }
+
+    int GetFanout () const
+    {
+        return m_nFanout;
+    }
+
+    // Counts reads and writes and moves to the fanout that is cheapest for
+    // their mix every TuneInterval operations. Enable it before sharing the
+    // list with readers; the read counter itself is safe under a shared lock.
+    void SetAutoTune (bool _bAutoTune)
+    {
+        m_bAutoTune = _bAutoTune;
+
+        if (m_bAutoTune && m_pkReads == nullptr) {
+            m_pkReads = new CRankReadCount[ReadStripes];
+        }
+
+        ResetReads ();
+        m_nWrites = 0;
+    }
+
+    bool IsRebuilding () const
+    {
+        return m_bRebuilding;
+    }
+
+    // Starts copying the entries into a shadow list shaped for the current
+    // fanout. Queries keep using this list; each SetRank/RemoveRank copies
+    // RebuildSteps more entries, or call Rebuild directly. Returns false while
+    // the previous shadow is still being rebuilt or reclaimed.
+    bool StartRebuild ()
+    {
+        if (m_pkShadow != nullptr) {
+            return false;
+        }
+
+        m_pkShadow = new CRankList (m_pkOwnedPool != nullptr ? nullptr : m_pkPool);
+        m_pkShadow->m_nFanout = m_nFanout;
+        m_pkShadow->SetLevelSizes ();
+
+        if (m_pkOwnedPool != nullptr)
+        {
+            m_pkShadow->SetPlacement (m_pkOwnedPool->IsHugePages (), m_pkOwnedPool->GetNumaNode ());
+            m_pkShadow->SetUpperLevel (m_pkOwnedPool->GetUpperLevel ());
+        }
+
+        m_bRebuilding = true;
+        m_nRebuildCursor = 0;
+
+        return true;
+    }
+
+    // Copies up to _nSteps entries. Once the copy has caught up, the shadow
+    // becomes this list and the old structure is reclaimed incrementally.
+    // Returns true while the rebuild is still running.
+    bool Rebuild (int _nSteps)
+    {
+        if (!m_bRebuilding) {
+            return false;
+        }
+
+        // The shadow holds the entries above the cursor, in the same order;
+        // writes landing there are applied to it as they happen.
+        if (m_nRebuildCursor < CalcCount (m_pkRoot))
+        {
+            TRankNode* node = GetBottomNode (QueryRank (m_nRebuildCursor + 1));
+            while (node != nullptr && _nSteps > 0)
+            {
+                m_pkShadow->UpdateRank (node->m_pkEntry->m_nID, node->m_pkEntry->m_nScore);
+                m_nRebuildCursor++;
+
+                node = node->m_pkNext;
+                _nSteps--;
+            }
+
+            return true;
+        }
+
+        SwapList (*m_pkShadow);
+
+        m_pkShadow->ClearIncremental ();
+        m_bRebuilding = false;
+
+        return false;
+    }
+
+    void Swap (CRankList& _rkRankList)
+    {
+        SwapList (_rkRankList);
+
+        std::swap (m_pkShadow, _rkRankList.m_pkShadow);
+        std::swap (m_bRebuilding, _rkRankList.m_bRebuilding);
+        std::swap (m_nRebuildCursor, _rkRankList.m_nRebuildCursor);
+    }
+
+    // DEBUG
+    void Print ()
+    {
+        TRankNode* node = m_pkRoot;
+        while (node != nullptr)
+        {
+            TRankNode* down = node->m_pkDown;
+            while (node != nullptr)
+            {
+                TRankNode* next = node->m_pkNext;
+                std::cout << "level: " << node->m_nLevel << ", count: " << node->m_nCount << ", id:" << node->m_pkEntry->m_nID << ", score: " << node->m_pkEntry->m_nScore << std::endl;
+                node = next;
+            }
+
+            node = down;
+        }
+    }
+
+    // Checks links, levels, widths, order, cached scores and the node map.
+    // Returns false and describes the first broken invariant in _rkError.
+    bool Validate (std::string& _rkError)
+    {
+        _rkError.clear ();
+
+        if (m_pkRoot == nullptr) {
+            return true;
+        }
+
+        if (m_pkRoot->m_pkUp != nullptr || m_pkRoot->m_pkPrev != nullptr)
+        {
+            _rkError = "root has up or prev";
+            return false;
+        }
+
+        int total = CalcCount (m_pkRoot);
+
+        TRankNode* head = m_pkRoot;
+        while (head != nullptr)
+        {
+            int level = head->m_nLevel;
+            int width = 0;
+            int index = 0;
+
+            for (TRankNode* node = head; node != nullptr; node = node->m_pkNext, index++)
+            {
+                std::string where = "level " + std::to_string (level) + ", node " + std::to_string (index) + ": ";
+
+                if (node->m_nLevel != level)
+                {
+                    _rkError = where + "level " + std::to_string (node->m_nLevel);
+                    return false;
+                }
+
+                if (node->m_pkNext != nullptr && node->m_pkNext->m_pkPrev != node)
+                {
+                    _rkError = where + "next does not link back";
+                    return false;
+                }
+
+                if (node->m_pkNext != nullptr && node->m_pkEntry->m_nScore < node->m_pkNext->m_pkEntry->m_nScore)
+                {
+                    _rkError = where + "score below next";
+                    return false;
+                }
+
+                if constexpr (TRankNode::IsCached)
+                {
+                    if (!(node->m_nKey == node->m_pkEntry->m_nScore))
+                    {
+                        _rkError = where + "stale cached score";
+                        return false;
+                    }
+                }
+
+                if (node->m_pkUp != nullptr && (node->m_pkUp->m_pkDown != node || node->m_pkUp->m_pkEntry != node->m_pkEntry))
+                {
+                    _rkError = where + "up does not match";
+                    return false;
+                }
+
+                TRankNode* down = node->m_pkDown;
+                if (down != nullptr)
+                {
+                    if (down->m_pkUp != node || down->m_pkEntry != node->m_pkEntry || down->m_nLevel != level - 1)
+                    {
+                        _rkError = where + "down does not match";
+                        return false;
+                    }
+
+                    TRankNode* end = node->m_pkNext != nullptr ? node->m_pkNext->m_pkDown : nullptr;
+
+                    int count = 0;
+                    for (TRankNode* child = down; child != end; child = child->m_pkNext)
+                    {
+                        if (child == nullptr)
+                        {
+                            _rkError = where + "next is not above a node of the level below";
+                            return false;
+                        }
+
+                        count += child->m_nCount;
+                    }
+
+                    if (count != node->m_nCount)
+                    {
+                        _rkError = where + "count " + std::to_string (node->m_nCount) + ", spans " + std::to_string (count);
+                        return false;
+                    }
+                }
+                else
+                {
+                    if (level != 1 || node->m_nCount != 1)
+                    {
+                        _rkError = where + "bottom node with count " + std::to_string (node->m_nCount);
+                        return false;
+                    }
+
+                    if (GetMapNode (node->m_pkEntry->m_nID) != GetTopNode (node))
+                    {
+                        _rkError = where + "map does not point at the tower top";
+                        return false;
+                    }
+                }
+
+                width += node->m_nCount;
+            }
+
+            if (width != total)
+            {
+                _rkError = "level " + std::to_string (level) + ": width " + std::to_string (width) + ", root spans " + std::to_string (total);
+                return false;
+            }
+
+            head = head->m_pkDown;
+        }
+
+        return true;
+    }
+
+    void CheckScore ()
     {
         TRankNode* node = m_pkRoot;
         while (node != nullptr)
@@ -251,10 +1627,10 @@ public:
             TRankNode* down = node->m_pkDown;
             if (down != nullptr && down->m_pkDown != nullptr)
             {
-                if (down->m_nScore != down->m_pkDown->m_nScore)
+                if (down->m_pkEntry != down->m_pkDown->m_pkEntry)
                 {
-                    std::cout << "node id: " << down->m_nID << ", score: " << down->m_nScore << std::endl;
-                    std::cout << "down id: " << down->m_pkDown->m_nID << ", score: " << down->m_pkDown->m_nScore << std::endl;
+                    std::cout << "node id: " << down->m_pkEntry->m_nID << ", score: " << down->m_pkEntry->m_nScore << std::endl;
+                    std::cout << "down id: " << down->m_pkDown->m_pkEntry->m_nID << ", score: " << down->m_pkDown->m_pkEntry->m_nScore << std::endl;
                 }
             }
 
@@ -263,95 +1639,527 @@ public:
                 TRankNode* next = node->m_pkNext;
                 if (next != nullptr && next->m_pkNext != nullptr)
                 {
-                    if (next->m_nScore < next->m_pkNext->m_nScore)
+                    if (next->m_pkEntry->m_nScore < next->m_pkNext->m_pkEntry->m_nScore)
                     {
-                        std::cout << "node id: " << next->m_nID << ", score: " << next->m_nScore << std::endl;
-                        std::cout << "next id: " << next->m_pkNext->m_nID << ", score: " << next->m_pkNext->m_nScore << std::endl;
+                        std::cout << "node id: " << next->m_pkEntry->m_nID << ", score: " << next->m_pkEntry->m_nScore << std::endl;
+                        std::cout << "next id: " << next->m_pkNext->m_pkEntry->m_nID << ", score: " << next->m_pkNext->m_pkEntry->m_nScore << std::endl;
                     }
                 }
 
-                node = next;
+                node = next;
+            }
+
+            node = down;
+        }
+    }
+
+    void CheckRank ()
+    {
+        TRankNode* node = m_pkRoot;
+        if (node == nullptr) {
+            return;
+        }
+
+        while (node->m_pkDown != nullptr) {
+            node = node->m_pkDown;
+        }
+
+        int rank = 0;
+        while (node != nullptr)
+        {
+            rank++;
+
+            TRankNode* result = QueryRank (rank);
+            if (result == nullptr) {
+                std::cout << "rank: " << rank << ", result: nullptr" << std::endl;
+            }
+            else {
+                if (node->m_pkEntry != result->m_pkEntry) {
+                    std::cout << "rank: " << rank << ", node: " << node->m_pkEntry->m_nID << ", result: " << result->m_pkEntry->m_nID << std::endl;
+                }
+            }
+
+            int getRank = GetRank (node->m_pkEntry->m_nID);
+            if (rank != getRank) {
+                std::cout << "rank: " << rank << ", node: " << node->m_pkEntry->m_nID << ", getRank: " << getRank << std::endl;
+            }
+
+            node = node->m_pkNext;
+        }
+    }
+
+    int GetMaxLevel ()
+    {
+        return m_pkRoot == nullptr ? 0 : m_pkRoot->m_nLevel;
+    }
+
+protected:
+    static void Prefetch (const void* _pkAddress)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch (_pkAddress);
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        _mm_prefetch (static_cast<const char*> (_pkAddress), _MM_HINT_T0);
+#else
+        (void) _pkAddress;
+#endif
+    }
+
+    static const TScore& GetNodeScore (const TRankNode* _pkNode)
+    {
+        if constexpr (TRankNode::IsCached) {
+            return _pkNode->m_nKey;
+        }
+        else {
+            return _pkNode->m_pkEntry->m_nScore;
+        }
+    }
+
+    // Refreshes the cached score of every level above _pkNode after its
+    // entry changed.
+    static void SetTowerKey (TRankNode* _pkNode)
+    {
+        if constexpr (TRankNode::IsCached)
+        {
+            TRankNode* node = _pkNode;
+            while (node != nullptr)
+            {
+                node->m_nKey = node->m_pkEntry->m_nScore;
+                node = node->m_pkUp;
+            }
+        }
+    }
+
+    TRankNode* GetTopNode (TRankNode* _pkNode)
+    {
+        TRankNode* node = _pkNode;
+        if (node != nullptr)
+        {
+            while (node->m_pkUp != nullptr) {
+                node = node->m_pkUp;
+            }
+        }
+
+        return node;
+    }
+
+    TRankNode* GetBottomNode (TRankNode* _pkNode)
+    {
+        TRankNode* node = _pkNode;
+        if (node != nullptr)
+        {
+            while (node->m_pkDown != nullptr) {
+                node = node->m_pkDown;
+            }
+        }
+
+        return node;
+    }
+
+    // Entries a node on _nLevel spans before it splits, fanout ^ (level - 1).
+    long long GetLevelSize (int _nLevel) const
+    {
+        return m_pkLevelSizes[std::clamp (_nLevel, 1, static_cast<int> (MaxLevel)) - 1];
+    }
+
+    // The table is shared by every list, a list only keeps a pointer to the
+    // row of its fanout.
+    void SetLevelSizes ()
+    {
+        static const auto levelSizes = [] {
+            std::array<std::array<long long, MaxLevel>, MaxFanout + 1> levelSizes {};
+            for (int fanout = MinFanout; fanout <= MaxFanout; fanout++)
+            {
+                long long size = 1;
+                for (int i = 0; i < MaxLevel; i++)
+                {
+                    levelSizes[fanout][i] = size;
+                    size = std::min (size * fanout, static_cast<long long> (INT_MAX) + 1);
+                }
+            }
+
+            return levelSizes;
+        } ();
+
+        m_pkLevelSizes = levelSizes[m_nFanout].data ();
+    }
+
+    void Maintain ()
+    {
+        if (IsReclaiming ()) {
+            Reclaim (ReclaimSteps);
+        }
+
+        if (m_bReshape && StartRebuild ()) {
+            m_bReshape = false;
+        }
+
+        if (m_bRebuilding) {
+            Rebuild (RebuildSteps);
+        }
+
+        if (m_bAutoTune)
+        {
+            m_nWrites++;
+            Tune ();
+        }
+    }
+
+    // Each list has ReadStripes counters and each thread adds to the one it
+    // maps to, so readers under a shared lock seldom write one cache line and
+    // reads are only ever counted for the list they hit.
+    void CountReads (size_t _nReads)
+    {
+        if (!m_bAutoTune) {
+            return;
+        }
+
+        m_pkReads[GetReadStripe ()].m_nReads.fetch_add (_nReads, std::memory_order_relaxed);
+    }
+
+    static int GetReadStripe ()
+    {
+        static std::atomic<int> nextStripe (0);
+        thread_local int stripe = nextStripe.fetch_add (1, std::memory_order_relaxed) % ReadStripes;
+
+        return stripe;
+    }
+
+    void ResetReads ()
+    {
+        if (m_pkReads == nullptr) {
+            return;
+        }
+
+        for (int i = 0; i < ReadStripes; i++) {
+            m_pkReads[i].m_nReads.store (0, std::memory_order_relaxed);
+        }
+    }
+
+    void Tune ()
+    {
+        uint64_t reads = 0;
+        for (int i = 0; i < ReadStripes; i++) {
+            reads += m_pkReads[i].m_nReads.load (std::memory_order_relaxed);
+        }
+
+        if (reads + m_nWrites < TuneInterval) {
+            return;
+        }
+
+        int fanout = ChooseFanout (reads, m_nWrites, m_nFanout);
+
+        ResetReads ();
+        m_nWrites = 0;
+
+        SetFanout (fanout);
+    }
+
+    // Cost of a GetRank and a SetRank at fanouts 2 to 8 relative to fanout 4,
+    // from medians over lists of 10K, 100K and 1M entries. Reads are flat
+    // from 4 to 6 and writes from 4 to 8, so 4 is close to best everywhere
+    // and 3 never wins.
+    static constexpr int TunedFanout = 2;
+    static constexpr std::array<double, 7> ReadCosts = { 1.31, 1.11, 1.00, 1.04, 1.03, 1.10, 1.22 };
+    static constexpr std::array<double, 7> WriteCosts = { 1.38, 1.11, 1.00, 0.96, 0.97, 0.98, 0.99 };
+
+    // A write costs about three reads at any fanout.
+    static constexpr double WriteWeight = 3.0;
+
+    // A rebuild copies every entry, so the fanout only changes for a gain of
+    // more than TuneMargin; a fanout outside the table always changes.
+    static constexpr double TuneMargin = 0.05;
+
+    static double GetFanoutCost (uint64_t _nReads, uint64_t _nWrites, int _nFanout)
+    {
+        size_t index = static_cast<size_t> (_nFanout - TunedFanout);
+
+        return static_cast<double> (_nReads) * ReadCosts[index] + static_cast<double> (_nWrites) * WriteWeight * WriteCosts[index];
+    }
+
+    static int ChooseFanout (uint64_t _nReads, uint64_t _nWrites, int _nFanout)
+    {
+        int best = TunedFanout;
+        for (int fanout = TunedFanout + 1; fanout < TunedFanout + static_cast<int> (ReadCosts.size ()); fanout++)
+        {
+            if (GetFanoutCost (_nReads, _nWrites, fanout) < GetFanoutCost (_nReads, _nWrites, best)) {
+                best = fanout;
+            }
+        }
+
+        if (_nFanout >= TunedFanout && _nFanout < TunedFanout + static_cast<int> (ReadCosts.size ()))
+        {
+            if (GetFanoutCost (_nReads, _nWrites, best) > GetFanoutCost (_nReads, _nWrites, _nFanout) * (1.0 - TuneMargin)) {
+                return _nFanout;
+            }
+        }
+
+        return best;
+    }
+
+    int FindRank (const TID& _nID)
+    {
+        TRankNode* mapNode = GetMapNode (_nID);
+        if (mapNode == nullptr) {
+            return 0;
+        }
+
+        return CalcRank (mapNode) + 1;
+    }
+
+    // Unsubscribe drops free slots from the end, so any window left is an
+    // active one.
+    bool IsNotifying () const
+    {
+        return m_pkEventSink != nullptr && !m_kWindows.empty ();
+    }
+
+    // Applies a write to the shadow right away, so it stays equal to the
+    // entries above the cursor, ties included, and the swap changes no rank.
+    // _nRank is the rank of _nID before the write. An entry that kept its rank
+    // only takes the new score; any other write here erased it and put it
+    // after the entries with its score, all of which are above it and so in
+    // the shadow, which does the same.
+    void TrackRebuild (const TID& _nID, int _nRank)
+    {
+        int rank = FindRank (_nID);
+
+        bool wasCopied = _nRank > 0 && _nRank <= m_nRebuildCursor;
+        if (wasCopied) {
+            m_nRebuildCursor--;
+        }
+
+        bool isCopied = rank > 0 && rank <= m_nRebuildCursor;
+        if (isCopied) {
+            m_nRebuildCursor++;
+        }
+
+        TRankNode* mapNode = GetMapNode (_nID);
+
+        if (wasCopied && isCopied && rank == _nRank)
+        {
+            TRankNode* shadowNode = GetBottomNode (m_pkShadow->GetMapNode (_nID));
+            shadowNode->m_pkEntry->m_nScore = mapNode->m_pkEntry->m_nScore;
+            SetTowerKey (shadowNode);
+            return;
+        }
+
+        if (wasCopied) {
+            m_pkShadow->EraseRank (_nID);
+        }
+
+        if (isCopied) {
+            m_pkShadow->UpdateRank (_nID, mapNode->m_pkEntry->m_nScore);
+        }
+    }
+
+    // _nRank is the rank of _nID before the write. Entries between the old
+    // and new rank shift by one, so besides _nID at most one entry crosses
+    // each edge of a window; it is looked up at its rank after the write.
+    void NotifyWindows (const TID& _nID, int _nRank)
+    {
+        TRankNode* mapNode = GetMapNode (_nID);
+        int rank = mapNode != nullptr ? CalcRank (mapNode) + 1 : 0;
+        TScore score = mapNode != nullptr ? mapNode->m_pkEntry->m_nScore : TScore ();
+
+        for (size_t i = 0; i < m_kWindows.size (); i++)
+        {
+            if (m_kWindows[i].second == 0) {
+                continue;
+            }
+
+            int window = static_cast<int> (i);
+            int first = m_kWindows[i].first;
+            int last = first + m_kWindows[i].second - 1;
+
+            bool wasInside = _nRank >= first && _nRank <= last;
+            bool isInside = rank >= first && rank <= last;
+            bool wasAbove = _nRank > 0 && _nRank < first;
+            bool isAbove = rank > 0 && rank < first;
+
+            if (wasInside && isInside) {
+                PushEvent (ERankEvent::Move, window, _nID, score, _nRank, rank);
+            }
+            else if (wasInside)
+            {
+                PushEvent (ERankEvent::Leave, window, _nID, score, _nRank, rank);
+
+                if (isAbove) {
+                    PushRankEvent (ERankEvent::Enter, window, first - 1, first);
+                }
+                else {
+                    PushRankEvent (ERankEvent::Enter, window, last + 1, last);
+                }
+            }
+            else if (isInside)
+            {
+                if (wasAbove) {
+                    PushRankEvent (ERankEvent::Leave, window, first, first - 1);
+                }
+                else {
+                    PushRankEvent (ERankEvent::Leave, window, last, last + 1);
+                }
+
+                PushEvent (ERankEvent::Enter, window, _nID, score, _nRank, rank);
+            }
+            else if (wasAbove && !isAbove)
+            {
+                PushRankEvent (ERankEvent::Leave, window, first, first - 1);
+                PushRankEvent (ERankEvent::Enter, window, last + 1, last);
+            }
+            else if (isAbove && !wasAbove)
+            {
+                PushRankEvent (ERankEvent::Leave, window, last, last + 1);
+                PushRankEvent (ERankEvent::Enter, window, first - 1, first);
+            }
+        }
+    }
+
+    void NotifyReset ()
+    {
+        if (m_pkEventSink == nullptr) {
+            return;
+        }
+
+        for (size_t i = 0; i < m_kWindows.size (); i++)
+        {
+            if (m_kWindows[i].second == 0) {
+                continue;
             }
 
-            node = down;
+            TRankEvent event;
+            event.m_eType = ERankEvent::Reset;
+            event.m_nWindow = static_cast<int> (i);
+
+            m_pkEventSink->PushEvent (event);
         }
     }
 
-    void CheckRank ()
+    void PushEvent (ERankEvent _eType, int _nWindow, const TID& _nID, const TScore& _nScore, int _nOldRank, int _nNewRank)
     {
-        TRankNode* node = m_pkRoot;
+        TRankEvent event;
+        event.m_eType = _eType;
+        event.m_nWindow = _nWindow;
+        event.m_nOldRank = _nOldRank;
+        event.m_nNewRank = _nNewRank;
+        event.m_nID = _nID;
+        event.m_nScore = _nScore;
+
+        m_pkEventSink->PushEvent (event);
+    }
+
+    // For an entry shifted across a window edge, found at _nNewRank. Nothing
+    // crosses when the list ends inside the window.
+    void PushRankEvent (ERankEvent _eType, int _nWindow, int _nOldRank, int _nNewRank)
+    {
+        TRankNode* node = GetBottomNode (QueryRank (_nNewRank));
         if (node == nullptr) {
             return;
         }
 
-        while (node->m_pkDown != nullptr) {
-            node = node->m_pkDown;
+        PushEvent (_eType, _nWindow, node->m_pkEntry->m_nID, node->m_pkEntry->m_nScore, _nOldRank, _nNewRank);
+    }
+
+    void UpdateRank (TID _nID, TScore _nScore)
+    {
+        TRankNode* mapNode = GetMapNode (_nID);
+        if (mapNode != nullptr && GetNodeScore (mapNode) == _nScore) {
+            return;
         }
 
-        int rank = 0;
-        while (node != nullptr)
-        {
-            rank++;
+        if (mapNode != nullptr) {
+            mapNode = GetBottomNode (mapNode);
 
-            TRankNode* result = QueryRank (rank);
-            if (result == nullptr) {
-                std::cout << "rank: " << rank << ", result: nullptr" << std::endl;
+            bool hasChanged = false;
+            if (mapNode->m_pkPrev != nullptr) {
+                hasChanged |= _nScore >= GetNodeScore (mapNode->m_pkPrev);
             }
-            else {
-                if (node->m_nID != result->m_nID) {
-                    std::cout << "rank: " << rank << ", node: " << node->m_nID << ", result: " << result->m_nID << std::endl;
-                }
+
+            if (mapNode->m_pkNext != nullptr) {
+                hasChanged |= _nScore < GetNodeScore (mapNode->m_pkNext);
             }
 
-            int getRank = GetRank (node->m_nID);
-            if (rank != getRank) {
-                std::cout << "rank: " << rank << ", node: " << node->m_nID << ", getRank: " << getRank << std::endl;
+            if (hasChanged) {
+                EraseRank (_nID);
+            }
+            else
+            {
+                mapNode->m_pkEntry->m_nScore = std::move (_nScore);
+                SetTowerKey (mapNode);
+                return;
             }
+        }
 
-            node = node->m_pkNext;
+        if (m_pkRoot == nullptr) {
+            CreateRoot (std::move (_nID), std::move (_nScore));
         }
-    }
+        else if (m_pkRoot != nullptr && GetNodeScore (m_pkRoot) < _nScore) {
+            InsertRoot (std::move (_nID), std::move (_nScore));
+        }
+        else
+        {
+            std::vector<TRankNode*> parents;
+            int size = std::max (m_pkRoot->m_nLevel - 1, 0);
+            parents.reserve (size);
 
-    int GetMaxLevel ()
-    {
-        return m_pkRoot == nullptr ? 0 : m_pkRoot->m_nLevel;
-    }
+            TRankNode* node = FindPrevNode (_nScore, parents);
+            if (node == nullptr) {
+                return;
+            }
 
-private:
-    TRankNode* GetTopNode (TRankNode* _pkNode)
-    {
-        TRankNode* node = _pkNode;
-        if (node != nullptr)
-        {
-            while (node->m_pkUp != nullptr) {
-                node = node->m_pkUp;
+            TRankNode* newNode = InsertNext (node, m_pkPool->PopEntry (std::move (_nID), std::move (_nScore)));
+            if (newNode == nullptr) {
+                return;
             }
-        }
 
-        return node;
+            TRankNode* topNode = newNode;
+            for (auto it = parents.rbegin (); it != parents.rend (); it++)
+            {
+                TRankNode* parent = *it;
+                if (parent == nullptr) {
+                    break;
+                }
+
+                parent->m_nCount++;
+
+                if (parent->m_pkDown != nullptr)
+                {
+                    if (parent->m_nCount > GetLevelSize (parent->m_nLevel)) {
+                        topNode = InsertUp (topNode, parent);
+                    }
+                }
+            }
+
+            if (CalcCount (m_pkRoot) > GetLevelSize (m_pkRoot->m_nLevel + 1)) {
+                IncreaseLevel ();
+            }
+        }
     }
 
-    TRankNode* GetBottomNode (TRankNode* _pkNode)
+    void EraseRank (const TID& _nID)
     {
-        TRankNode* node = _pkNode;
-        if (node != nullptr)
-        {
-            while (node->m_pkDown != nullptr) {
-                node = node->m_pkDown;
-            }
+        if (m_pkRoot != nullptr && m_pkRoot->m_pkEntry->m_nID == _nID) {
+            RemoveRoot ();
+        }
+        else {
+            RemoveNode (GetMapNode (_nID));
         }
 
-        return node;
+        RemoveMapNode (_nID);
+
+        while (m_pkRoot != nullptr && m_pkRoot->m_nLevel > 2 && CalcCount (m_pkRoot) <= GetLevelSize (m_pkRoot->m_nLevel - 1)) {
+            DecreaseLevel ();
+        }
     }
 
-    TRankNode* FindPrevNode (TScore _nScore, std::vector<TRankNode*>& _rkParents)
+    TRankNode* FindPrevNode (const TScore& _nScore, std::vector<TRankNode*>& _rkParents)
     {
         TRankNode* node = m_pkRoot;
         while (node != nullptr)
         {
             while (node->m_pkNext != nullptr)
             {
-                if (node->m_pkNext->m_nScore < _nScore) {
+                if (GetNodeScore (node->m_pkNext) < _nScore) {
                     break;
                 }
 
@@ -376,6 +2184,8 @@ private:
             return;
         }
 
+        m_kUnderfull.clear ();
+
         TRankNode* parent = top;
         while (parent != nullptr)
         {
@@ -383,6 +2193,8 @@ private:
             {
                 parent = parent->m_pkUp;
                 parent->m_nCount--;
+
+                m_kUnderfull.emplace_back (parent);
             }
 
             parent = parent->m_pkPrev;
@@ -407,9 +2219,46 @@ private:
             }
 
             TRankNode* down = node->m_pkDown;
+            if (down == nullptr) {
+                m_pkPool->PushEntry (node->m_pkEntry);
+            }
+
             PushNode (node);
             node = down;
         }
+
+        // Mirror of the split in SetRank: a tower top that dropped below half
+        // its share is folded into prev when both fit under one node.
+        for (auto it = m_kUnderfull.rbegin (); it != m_kUnderfull.rend (); it++)
+        {
+            TRankNode* underfull = *it;
+            if (underfull->m_pkUp != nullptr || underfull->m_pkPrev == nullptr) {
+                continue;
+            }
+
+            long long size = GetLevelSize (underfull->m_nLevel);
+            if (underfull->m_nCount * 2 < size && underfull->m_nCount + underfull->m_pkPrev->m_nCount <= size) {
+                DemoteNode (underfull);
+            }
+        }
+    }
+
+    void DemoteNode (TRankNode* _pkNode)
+    {
+        TRankNode* prev = _pkNode->m_pkPrev;
+        prev->m_nCount += _pkNode->m_nCount;
+        prev->m_pkNext = _pkNode->m_pkNext;
+
+        if (_pkNode->m_pkNext != nullptr) {
+            _pkNode->m_pkNext->m_pkPrev = prev;
+        }
+
+        TRankNode* down = _pkNode->m_pkDown;
+        down->m_pkUp = nullptr;
+
+        SetMapNode (down);
+
+        PushNode (_pkNode);
     }
 
     void CreateRoot (TID _nID, TScore _nScore)
@@ -418,9 +2267,11 @@ private:
             return;
         }
 
-        m_pkRoot = PopNode (2, 1, _nID, _nScore);
+        TRankEntry* entry = m_pkPool->PopEntry (std::move (_nID), std::move (_nScore));
+
+        m_pkRoot = PopNode (2, 1, entry);
 
-        TRankNode* newNode = PopNode (1, 1, _nID, _nScore);
+        TRankNode* newNode = PopNode (1, 1, entry);
         newNode->m_pkUp = m_pkRoot;
 
         m_pkRoot->m_pkDown = newNode;
@@ -434,16 +2285,20 @@ private:
             return;
         }
 
-        TRankNode* newNode = InsertNext (GetBottomNode (m_pkRoot), m_pkRoot->m_nID, m_pkRoot->m_nScore);
+        TRankNode* newNode = InsertNext (GetBottomNode (m_pkRoot), m_pkRoot->m_pkEntry);
         if (newNode == nullptr) {
             return;
         }
 
+        TRankEntry* entry = m_pkPool->PopEntry (std::move (_nID), std::move (_nScore));
+
         TRankNode* node = m_pkRoot;
         while (node != nullptr)
         {
-            node->m_nID = _nID;
-            node->m_nScore = _nScore;
+            node->m_pkEntry = entry;
+            if constexpr (TRankNode::IsCached) {
+                node->m_nKey = entry->m_nScore;
+            }
 
             if (node->m_pkDown != nullptr) {
                 node->m_nCount++;
@@ -453,6 +2308,20 @@ private:
         }
 
         SetMapNode (m_pkRoot);
+
+        // The old root entry now sits second, inside the span of every root
+        // node, so those split and the list grows as for any other insert.
+        TRankNode* topNode = newNode;
+        for (TRankNode* parent = GetBottomNode (m_pkRoot)->m_pkUp; parent != nullptr; parent = parent->m_pkUp)
+        {
+            if (parent->m_nCount > GetLevelSize (parent->m_nLevel)) {
+                topNode = InsertUp (topNode, parent);
+            }
+        }
+
+        if (CalcCount (m_pkRoot) > GetLevelSize (m_pkRoot->m_nLevel + 1)) {
+            IncreaseLevel ();
+        }
     }
 
     void RemoveRoot ()
@@ -469,14 +2338,20 @@ private:
         TRankNode* next = bottom->m_pkNext;
         if (next != nullptr)
         {
-            TID id = next->m_nID;
-            TScore score = next->m_nScore;
+            TRankEntry* entry = next->m_pkEntry;
+
+            // The removed entry leaves with the bottom node of next, which is
+            // the one RemoveNode hands back to the pool.
+            next->m_pkEntry = m_pkRoot->m_pkEntry;
 
             TRankNode* node = m_pkRoot;
             while (node != nullptr)
             {
-                node->m_nID = id;
-                node->m_nScore = score;
+                node->m_pkEntry = entry;
+                if constexpr (TRankNode::IsCached) {
+                    node->m_nKey = entry->m_nScore;
+                }
+
                 node = node->m_pkDown;
             }
 
@@ -492,7 +2367,7 @@ private:
         }
     }
 
-    TRankNode* InsertNext (TRankNode* _pkNode, TID _nID, TScore _nScore)
+    TRankNode* InsertNext (TRankNode* _pkNode, TRankEntry* _pkEntry)
     {
         if (_pkNode == nullptr) {
             return nullptr;
@@ -502,7 +2377,7 @@ private:
             return nullptr;
         }
 
-        TRankNode* newNode = PopNode (1, 1, _nID, _nScore);
+        TRankNode* newNode = PopNode (1, 1, _pkEntry);
         newNode->m_pkNext = _pkNode->m_pkNext;
         newNode->m_pkPrev = _pkNode;
 
@@ -526,7 +2401,7 @@ private:
             return nullptr;
         }
 
-        TRankNode* newNode = PopNode (_pkParent->m_nLevel, CalcCount (_pkNode), _pkNode->m_nID, _pkNode->m_nScore);
+        TRankNode* newNode = PopNode (_pkParent->m_nLevel, CalcCount (_pkNode), _pkNode->m_pkEntry);
         newNode->m_pkDown = _pkNode;
         newNode->m_pkNext = _pkParent->m_pkNext;
         newNode->m_pkPrev = _pkParent;
@@ -550,7 +2425,7 @@ private:
             return;
         }
 
-        TRankNode* newNode = PopNode (m_pkRoot->m_nLevel + 1, CalcCount (m_pkRoot), m_pkRoot->m_nID, m_pkRoot->m_nScore);
+        TRankNode* newNode = PopNode (m_pkRoot->m_nLevel + 1, CalcCount (m_pkRoot), m_pkRoot->m_pkEntry);
         newNode->m_pkDown = m_pkRoot;
 
         m_pkRoot->m_pkUp = newNode;
@@ -559,6 +2434,31 @@ private:
         SetMapNode (m_pkRoot);
     }
 
+    // Drops the root level. Every node on it becomes a tower top one level
+    // lower, so the counts below already add up.
+    void DecreaseLevel ()
+    {
+        if (m_pkRoot == nullptr || m_pkRoot->m_nLevel <= 2) {
+            return;
+        }
+
+        TRankNode* down = m_pkRoot->m_pkDown;
+
+        TRankNode* node = m_pkRoot;
+        while (node != nullptr)
+        {
+            TRankNode* next = node->m_pkNext;
+
+            node->m_pkDown->m_pkUp = nullptr;
+            SetMapNode (node->m_pkDown);
+
+            PushNode (node);
+            node = next;
+        }
+
+        m_pkRoot = down;
+    }
+
     int CalcRank (TRankNode* _pkNode)
     {
         if (_pkNode == nullptr) {
@@ -639,6 +2539,40 @@ private:
         return node;
     }
 
+    // Number of leading entries whose score satisfies _rkPred. The predicate
+    // must hold for a prefix of the rank order.
+    template<typename TPred>
+    int CountWhile (const TPred& _rkPred)
+    {
+        if (m_pkRoot == nullptr || !_rkPred (GetNodeScore (m_pkRoot))) {
+            return 0;
+        }
+
+        int count = 0;
+
+        TRankNode* node = m_pkRoot;
+        while (node != nullptr)
+        {
+            while (node->m_pkNext != nullptr)
+            {
+                if (!_rkPred (GetNodeScore (node->m_pkNext))) {
+                    break;
+                }
+
+                count += node->m_nCount;
+                node = node->m_pkNext;
+            }
+
+            if (node->m_pkDown == nullptr) {
+                return count + 1;
+            }
+
+            node = node->m_pkDown;
+        }
+
+        return count;
+    }
+
     void QueryRanks (int _nRank, int _nSize, std::vector<TRankNode*>& _rkRankNodes)
     {
         _rkRankNodes.clear ();
@@ -665,37 +2599,49 @@ private:
         }
     }
 
-    TRankNode* GetMapNode (TID _nID)
+    virtual TRankNode* GetMapNode (const TID& _nID)
     {
-        auto it = m_kNodeMap.find (_nID);
-        if (it == m_kNodeMap.end ()) {
+        if (m_pkNodeMap == nullptr) {
+            return nullptr;
+        }
+
+        auto it = m_pkNodeMap->find (_nID);
+        if (it == m_pkNodeMap->end ()) {
             return nullptr;
         }
 
         return it->second;
     }
 
-    void SetMapNode (TRankNode* _pkNode)
+    virtual void SetMapNode (TRankNode* _pkNode)
     {
         if (_pkNode == nullptr) {
             return;
         }
 
-        TID id = _pkNode->m_nID;
+        if (m_pkNodeMap == nullptr) {
+            m_pkNodeMap = CreateNodeMap ();
+        }
+
+        const TID& id = _pkNode->m_pkEntry->m_nID;
 
-        auto it = m_kNodeMap.find (id);
-        if (it == m_kNodeMap.end ()) {
-            m_kNodeMap.emplace (id, _pkNode);
+        auto it = m_pkNodeMap->find (id);
+        if (it == m_pkNodeMap->end ()) {
+            m_pkNodeMap->emplace (id, _pkNode);
         }
         else {
             it->second = _pkNode;
         }
     }
 
-    void RemoveMapNode (TID _nID)
+    virtual void RemoveMapNode (const TID& _nID)
     {
-        auto it = m_kNodeMap.find (_nID);
-        if (it == m_kNodeMap.end ()) {
+        if (m_pkNodeMap == nullptr) {
+            return;
+        }
+
+        auto it = m_pkNodeMap->find (_nID);
+        if (it == m_pkNodeMap->end ()) {
             return;
         }
         else {
@@ -703,76 +2649,157 @@ private:
         }
     }
 
-    TRankNode* PopNode (int _nLevel, int _nCount, TID _nID, TScore _nScore)
+    TRankNode* PopNode (int _nLevel, int _nCount, TRankEntry* _pkEntry)
     {
-        if (!m_kPool.empty ())
-        {
-            TRankNode* node = m_kPool.back ();
-
-            node->m_nLevel = _nLevel;
-            node->m_nCount = _nCount;
-            node->m_nID = _nID;
-            node->m_nScore = _nScore;
-
-            m_kPool.pop_back ();
-
-            return node;
-        }
-        else {
-            return new TRankNode (_nLevel, _nCount, _nID, _nScore);
-        }
+        return m_pkPool->PopNode (_nLevel, _nCount, _pkEntry);
     }
 
     void PushNode (TRankNode* _pkNode)
     {
-        if (_pkNode == nullptr) {
-            return;
-        }
-
-        _pkNode->m_pkUp = nullptr;
-        _pkNode->m_pkDown = nullptr;
-        _pkNode->m_pkPrev = nullptr;
-        _pkNode->m_pkNext = nullptr;
-
-        m_kPool.emplace_back (_pkNode);
+        m_pkPool->PushNode (_pkNode);
     }
 
     void ClearList ()
     {
-        TRankNode* node = m_pkRoot;
-        while (node != nullptr)
+        if (m_pkOwnedPool != nullptr)
         {
-            TRankNode* down = node->m_pkDown;
+            m_kRetired.clear ();
+            DropNodeMaps ();
+        }
+
+        for (TNodeMap* retiredMap : m_kRetiredMaps) {
+            delete retiredMap;
+        }
+
+        m_kRetiredMaps.clear ();
+
+        while (!m_kRetired.empty ()) {
+            Reclaim (ReclaimSteps);
+        }
+
+        if (m_pkOwnedPool == nullptr)
+        {
+            TRankNode* node = m_pkRoot;
             while (node != nullptr)
             {
-                TRankNode* next = node->m_pkNext;
-                delete node;
-                node = next;
+                TRankNode* down = node->m_pkDown;
+                while (node != nullptr)
+                {
+                    TRankNode* next = node->m_pkNext;
+                    if (down == nullptr) {
+                        m_pkPool->PushEntry (node->m_pkEntry);
+                    }
+
+                    PushNode (node);
+                    node = next;
+                }
+                node = down;
             }
-            node = down;
         }
 
         m_pkRoot = nullptr;
-        m_kNodeMap.clear ();
+
+        delete m_pkNodeMap;
+        m_pkNodeMap = nullptr;
     }
 
-    void ClearPool ()
+    // The maps of an owned pool need not be destroyed one node at a time:
+    // their nodes are in its slot arena, which ClearPool resets next, and
+    // their bucket arrays go to its Release. Only IDs without a destructor
+    // can be left behind that way.
+    void DropNodeMaps ()
     {
-        for (auto& node : m_kPool)
+        if constexpr (std::is_trivially_destructible<TID>::value)
         {
-            if (node != nullptr) {
-                delete node;
+            for (TNodeMap* retiredMap : m_kRetiredMaps) {
+                ::operator delete (retiredMap);
             }
+
+            m_kRetiredMaps.clear ();
+
+            ::operator delete (m_pkNodeMap);
+            m_pkNodeMap = nullptr;
+
+            m_pkPool->GetMapStorage ()->Drop ();
+        }
+    }
+
+    void ClearPool ()
+    {
+        if (m_pkOwnedPool != nullptr)
+        {
+            m_pkOwnedPool->Reset ();
+            m_pkOwnedPool->Release (INT_MAX);
+        }
+    }
+
+    // The map is created by the first SetMapNode, so lists whose IDs are
+    // indexed elsewhere, like the boards of CRankBoardSet, never carry one.
+    TNodeMap* CreateNodeMap ()
+    {
+        typename TNodeMap::allocator_type allocator (m_pkPool->IsHugePages (), m_pkPool->GetNumaNode (), m_pkPool->GetMapStorage ());
+
+        return new TNodeMap (0, std::hash<TID> (), std::equal_to<TID> (), allocator);
+    }
+
+    void SetMapPlacement ()
+    {
+        if (m_pkNodeMap == nullptr) {
+            return;
         }
 
-        m_kPool.clear ();
-        m_kPool.shrink_to_fit ();
+        TNodeMap* nodeMap = CreateNodeMap ();
+        nodeMap->reserve (m_pkNodeMap->size ());
+        nodeMap->insert (m_pkNodeMap->begin (), m_pkNodeMap->end ());
+
+        delete m_pkNodeMap;
+        m_pkNodeMap = nodeMap;
+    }
+
+    void ClearShadow ()
+    {
+        delete m_pkShadow;
+
+        m_pkShadow = nullptr;
+        m_bRebuilding = false;
+    }
+
+    void SwapList (CRankList& _rkRankList)
+    {
+        std::swap (m_pkRoot, _rkRankList.m_pkRoot);
+
+        std::swap (m_pkNodeMap, _rkRankList.m_pkNodeMap);
+        m_kRetired.swap (_rkRankList.m_kRetired);
+        m_kRetiredMaps.swap (_rkRankList.m_kRetiredMaps);
+
+        std::swap (m_pkOwnedPool, _rkRankList.m_pkOwnedPool);
+        std::swap (m_pkPool, _rkRankList.m_pkPool);
     }
 
 protected:
     TRankNode* m_pkRoot;
-    std::unordered_map<TID, TRankNode*> m_kNodeMap;
+    TNodeMap* m_pkNodeMap;
 
 private:
-    std::vector<TRankNode*> m_kPool;
+    int m_nFanout;
+    const long long* m_pkLevelSizes;
+    bool m_bAutoTune;
+    CRankReadCount* m_pkReads;
+    uint64_t m_nWrites;
+    bool m_bReshape;
+
+    CRankList* m_pkShadow;
+    bool m_bRebuilding;
+    int m_nRebuildCursor;
+
+    TRankEventSink* m_pkEventSink;
+    std::vector<std::pair<int, int>> m_kWindows;
+
+    std::vector<TRankNode*> m_kUnderfull;
+
+    TRankPool* m_pkOwnedPool;
+    TRankPool* m_pkPool;
+
+    std::vector<TRankNode*> m_kRetired;
+    std::vector<TNodeMap*> m_kRetiredMaps;
 };
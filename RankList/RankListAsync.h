@@ -0,0 +1,408 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "RankList.h"
+
+template<typename TID, typename TScore>
+class CRankCommand
+{
+public:
+    CRankCommand ()
+        : m_pkNext (nullptr)
+        , m_nSeq (0)
+        , m_nID ()
+        , m_nScore ()
+        , m_bRemove (false)
+    {
+    }
+
+    CRankCommand (uint64_t _nSeq, TID _nID, TScore _nScore, bool _bRemove)
+        : m_pkNext (nullptr)
+        , m_nSeq (_nSeq)
+        , m_nID (std::move (_nID))
+        , m_nScore (std::move (_nScore))
+        , m_bRemove (_bRemove)
+    {
+    }
+
+    std::atomic<CRankCommand*> m_pkNext;
+    uint64_t m_nSeq;
+    TID m_nID;
+    TScore m_nScore;
+    bool m_bRemove;
+};
+
+// Multi-producer single-consumer queue (Vyukov). Push is wait-free, Pop may
+// only be called from the writer thread.
+template<typename TID, typename TScore>
+class CRankCommandQueue
+{
+public:
+    using TRankCommand = CRankCommand<TID, TScore>;
+
+public:
+    CRankCommandQueue ()
+        : m_pkHead (&m_kStub)
+        , m_pkTail (&m_kStub)
+    {
+    }
+
+    CRankCommandQueue (const CRankCommandQueue&) = delete;
+
+    virtual ~CRankCommandQueue ()
+    {
+        TRankCommand command;
+        while (Pop (command)) {
+        }
+
+        if (m_pkTail != &m_kStub) {
+            delete m_pkTail;
+        }
+    }
+
+    void Push (TRankCommand* _pkCommand)
+    {
+        _pkCommand->m_pkNext.store (nullptr, std::memory_order_relaxed);
+
+        TRankCommand* prev = m_pkHead.exchange (_pkCommand, std::memory_order_acq_rel);
+        prev->m_pkNext.store (_pkCommand, std::memory_order_release);
+    }
+
+    bool Pop (TRankCommand& _rkCommand)
+    {
+        TRankCommand* tail = m_pkTail;
+        TRankCommand* next = tail->m_pkNext.load (std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+
+        _rkCommand.m_nSeq = next->m_nSeq;
+        _rkCommand.m_nID = std::move (next->m_nID);
+        _rkCommand.m_nScore = std::move (next->m_nScore);
+        _rkCommand.m_bRemove = next->m_bRemove;
+
+        m_pkTail = next;
+
+        if (tail != &m_kStub) {
+            delete tail;
+        }
+
+        return true;
+    }
+
+private:
+    TRankCommand m_kStub;
+    std::atomic<TRankCommand*> m_pkHead;
+    TRankCommand* m_pkTail;
+};
+
+template<RankID TID, RankScore TScore, int N = 4>
+class CRankListAsync
+{
+public:
+    using TRankList = CRankList<TID, TScore, N>;
+    using TRankCommand = CRankCommand<TID, TScore>;
+
+    static constexpr int MaxDrainSize = 4096;
+    static constexpr int ApplySize = 256;
+
+public:
+    CRankListAsync ()
+        : m_nSeq (0)
+        , m_nApplied (0)
+        , m_bSleeping (false)
+        , m_bStop (false)
+    {
+        m_kWriter = std::thread (&CRankListAsync::Run, this);
+    }
+
+    CRankListAsync (const CRankListAsync&) = delete;
+
+    virtual ~CRankListAsync ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (m_kWakeMutex);
+            m_bStop = true;
+        }
+
+        m_kWake.notify_one ();
+        m_kWriter.join ();
+    }
+
+    uint64_t SetRank (TID _nID, TScore _nScore)
+    {
+        return Push (std::move (_nID), std::move (_nScore), false);
+    }
+
+    uint64_t RemoveRank (TID _nID)
+    {
+        return Push (std::move (_nID), TScore (), true);
+    }
+
+    void SetAutoTune (bool _bAutoTune)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.SetAutoTune (_bAutoTune);
+    }
+
+    // Without a NUMA node the writer thread, which allocates and first
+    // touches every node, decides placement; start it on the socket that
+    // should own the list.
+    void SetPlacement (bool _bHugePages, int _nNumaNode)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.SetPlacement (_bHugePages, _nNumaNode);
+    }
+
+    void SetUpperLevel (int _nUpperLevel)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.SetUpperLevel (_nUpperLevel);
+    }
+
+    // The sink is called on the writer thread, see CRankEventStream.
+    void SetEventSink (CRankEventSink<TID, TScore>* _pkEventSink)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.SetEventSink (_pkEventSink);
+    }
+
+    int Subscribe (int _nRank, int _nSize)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        return m_kRankList.Subscribe (_nRank, _nSize);
+    }
+
+    void Unsubscribe (int _nWindow)
+    {
+        std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.Unsubscribe (_nWindow);
+    }
+
+    bool IsVisible (uint64_t _nSeq)
+    {
+        return m_nApplied.load (std::memory_order_acquire) >= _nSeq;
+    }
+
+    void WaitFor (uint64_t _nSeq)
+    {
+        if (IsVisible (_nSeq)) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock (m_kAppliedMutex);
+        m_kApplied.wait (lock, [this, _nSeq] { return IsVisible (_nSeq); });
+    }
+
+    void Flush ()
+    {
+        WaitFor (m_nSeq.load (std::memory_order_acquire));
+    }
+
+    TScore GetScore (TID _nID)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        return m_kRankList.GetScore (_nID);
+    }
+
+    int GetRank (TID _nID)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        return m_kRankList.GetRank (_nID);
+    }
+
+    void GetRanks (std::span<const TID> _kIDs, std::vector<std::pair<int, TScore>>& _rkRanks)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.GetRanks (_kIDs, _rkRanks);
+    }
+
+    void GetRankList (std::vector<std::pair<TID, TScore>>& _rkRankList)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.GetRankList (_rkRankList);
+    }
+
+    void GetRankList (int _nRank, int _nSize, std::vector<std::pair<TID, TScore>>& _rkRankList)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        m_kRankList.GetRankList (_nRank, _nSize, _rkRankList);
+    }
+
+    bool Validate (std::string& _rkError)
+    {
+        std::shared_lock<std::shared_mutex> lock (m_kListMutex);
+        return m_kRankList.Validate (_rkError);
+    }
+
+private:
+    uint64_t Push (TID _nID, TScore _nScore, bool _bRemove)
+    {
+        // The command is built before it takes a sequence number, so a
+        // failed allocation or copy leaves no gap in the numbers and the
+        // writer never waits long on a number whose command is not linked
+        // yet. Pairs with Run: either the writer sees the new sequence before
+        // it sleeps, or this sees m_bSleeping and wakes it. Both sides need
+        // seq_cst for that.
+        TRankCommand* command = new TRankCommand (0, std::move (_nID), std::move (_nScore), _bRemove);
+
+        uint64_t seq = m_nSeq.fetch_add (1, std::memory_order_seq_cst) + 1;
+        command->m_nSeq = seq;
+
+        m_kQueue.Push (command);
+
+        if (m_bSleeping.load (std::memory_order_seq_cst))
+        {
+            std::lock_guard<std::mutex> lock (m_kWakeMutex);
+            m_kWake.notify_one ();
+        }
+
+        return seq;
+    }
+
+    void Run ()
+    {
+        while (true)
+        {
+            if (Drain () > 0) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock (m_kWakeMutex);
+            m_bSleeping.store (true, std::memory_order_seq_cst);
+
+            if (m_bStop && !IsPending ())
+            {
+                m_bSleeping.store (false, std::memory_order_relaxed);
+                break;
+            }
+
+            // A sequence taken but not yet linked into the queue keeps this
+            // awake; the producer is between two stores in Push.
+            m_kWake.wait (lock, [this] { return m_bStop || IsPending (); });
+            m_bSleeping.store (false, std::memory_order_relaxed);
+        }
+    }
+
+    bool IsPending () const
+    {
+        return m_nSeq.load (std::memory_order_seq_cst) != m_nApplied.load (std::memory_order_relaxed);
+    }
+
+    // Applies up to MaxDrainSize commands, ApplySize at a time, and releases
+    // the list lock between chunks so a reader waits for one chunk at most.
+    int Drain ()
+    {
+        int count = 0;
+        while (count < MaxDrainSize)
+        {
+            int size = Apply ();
+            if (size == 0) {
+                break;
+            }
+
+            count += size;
+        }
+
+        return count;
+    }
+
+    // Updates to one ID are merged within a chunk only, so readers between
+    // chunks still see the commands applied in the order they were popped.
+    int Apply ()
+    {
+        m_kBatch.clear ();
+        m_kBatchIndex.clear ();
+
+        int size = 0;
+
+        TRankCommand command;
+        while (size < ApplySize && m_kQueue.Pop (command))
+        {
+            m_kPending.push (command.m_nSeq);
+            size++;
+
+            auto it = m_kBatchIndex.find (command.m_nID);
+            if (it == m_kBatchIndex.end ())
+            {
+                m_kBatchIndex.emplace (command.m_nID, m_kBatch.size ());
+                m_kBatch.emplace_back (command.m_nID, std::make_pair (command.m_nScore, command.m_bRemove));
+            }
+            else {
+                m_kBatch[it->second].second = std::make_pair (std::move (command.m_nScore), command.m_bRemove);
+            }
+        }
+
+        if (size == 0) {
+            return 0;
+        }
+
+        {
+            std::unique_lock<std::shared_mutex> lock (m_kListMutex);
+
+            for (auto& update : m_kBatch)
+            {
+                if (update.second.second) {
+                    m_kRankList.RemoveRank (update.first);
+                }
+                else {
+                    m_kRankList.SetRank (update.first, std::move (update.second.first));
+                }
+            }
+        }
+
+        // Producers link commands in a different order than they took their
+        // sequence numbers, so only advance over a contiguous run of applied
+        // numbers.
+        uint64_t applied = m_nApplied.load (std::memory_order_relaxed);
+        while (!m_kPending.empty () && m_kPending.top () == applied + 1)
+        {
+            applied++;
+            m_kPending.pop ();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (m_kAppliedMutex);
+            m_nApplied.store (applied, std::memory_order_release);
+        }
+
+        m_kApplied.notify_all ();
+
+        return size;
+    }
+
+private:
+    TRankList m_kRankList;
+    std::shared_mutex m_kListMutex;
+
+    CRankCommandQueue<TID, TScore> m_kQueue;
+    std::atomic<uint64_t> m_nSeq;
+    std::atomic<uint64_t> m_nApplied;
+
+    std::mutex m_kAppliedMutex;
+    std::condition_variable m_kApplied;
+
+    std::mutex m_kWakeMutex;
+    std::condition_variable m_kWake;
+    std::atomic<bool> m_bSleeping;
+    bool m_bStop;
+
+    std::vector<std::pair<TID, std::pair<TScore, bool>>> m_kBatch;
+    std::unordered_map<TID, size_t> m_kBatchIndex;
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>> m_kPending;
+
+    std::thread m_kWriter;
+};
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Whole-page allocations for the arenas and ID index of very large lists. A
+// descent touches one node per level, each on a different page once the list
+// outgrows the cache, so 2 MB pages cut most of its TLB misses. A NUMA node
+// of -1 leaves placement to first touch: the pages land on the node of the
+// thread that first writes them, which for CRankListAsync is the writer.
+class CRankMemory
+{
+public:
+    static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+    static constexpr int MaxNumaNode = 1023;
+
+public:
+    static size_t GetPageBytes (size_t _nBytes)
+    {
+        return (_nBytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+    }
+
+    // Granularity of AllocateNodePages: the page size, or on Windows the
+    // 64 KB that VirtualAlloc reserves at a time.
+    static size_t GetNodePageSize ()
+    {
+        static const size_t pageSize = QueryNodePageSize ();
+
+        return pageSize;
+    }
+
+    static size_t GetNodePageBytes (size_t _nBytes)
+    {
+        size_t pageSize = GetNodePageSize ();
+
+        return (_nBytes + pageSize - 1) / pageSize * pageSize;
+    }
+
+    // Rounds _nBytes up to whole huge pages. Huge pages are a request, not a
+    // guarantee: without reserved pages or privileges this falls back to
+    // normal pages, which on Linux are still aligned for transparent huge
+    // pages.
+    static void* AllocatePages (size_t _nBytes, bool _bHugePages, int _nNumaNode)
+    {
+        size_t bytes = GetPageBytes (_nBytes);
+
+#if defined(_WIN32)
+        void* pages = nullptr;
+
+        // MEM_LARGE_PAGES needs SeLockMemoryPrivilege on the process token.
+        SIZE_T largePageSize = GetLargePageMinimum ();
+        if (_bHugePages && largePageSize > 0 && bytes % largePageSize == 0) {
+            pages = VirtualAllocPages (bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, _nNumaNode);
+        }
+
+        if (pages == nullptr) {
+            pages = VirtualAllocPages (bytes, MEM_RESERVE | MEM_COMMIT, _nNumaNode);
+        }
+
+        if (pages == nullptr) {
+            throw std::bad_alloc ();
+        }
+
+        return pages;
+#elif defined(__linux__)
+        void* pages = MAP_FAILED;
+
+        if (_bHugePages)
+        {
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+            flags |= 21 << MAP_HUGE_SHIFT;
+#endif
+            pages = mmap (nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        }
+
+        if (pages == MAP_FAILED)
+        {
+            // Maps one page more and trims both ends to a huge page boundary.
+            char* base = static_cast<char*> (mmap (nullptr, bytes + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (base == MAP_FAILED) {
+                throw std::bad_alloc ();
+            }
+
+            size_t head = (HugePageSize - reinterpret_cast<uintptr_t> (base) % HugePageSize) % HugePageSize;
+            if (head > 0) {
+                munmap (base, head);
+            }
+
+            munmap (base + head + bytes, HugePageSize - head);
+
+            pages = base + head;
+
+            if (_bHugePages) {
+                madvise (pages, bytes, MADV_HUGEPAGE);
+            }
+        }
+
+        PreferNumaNode (pages, bytes, _nNumaNode);
+
+        return pages;
+#else
+        (void) _bHugePages;
+        (void) _nNumaNode;
+
+        return ::operator new (bytes, std::align_val_t (HugePageSize));
+#endif
+    }
+
+    static void FreePages (void* _pkPages, size_t _nBytes)
+    {
+#if defined(_WIN32)
+        (void) _nBytes;
+
+        VirtualFree (_pkPages, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap (_pkPages, GetPageBytes (_nBytes));
+#else
+        (void) _nBytes;
+
+        ::operator delete (_pkPages, std::align_val_t (HugePageSize));
+#endif
+    }
+
+    // Frees a run from AllocatePages _nChunk bytes at a time, a multiple of
+    // HugePageSize, so a large run is not one long unmap. Returns false while
+    // some is left; _rnFreed counts the bytes freed so far. Windows decommits
+    // the parts and releases the run with the last one, other platforms free
+    // it whole on the first call.
+    static bool FreePagesStep (void* _pkPages, size_t _nBytes, size_t& _rnFreed, size_t _nChunk)
+    {
+        size_t bytes = GetPageBytes (_nBytes);
+
+#if defined(_WIN32)
+        if (_rnFreed + _nChunk < bytes)
+        {
+            VirtualFree (static_cast<char*> (_pkPages) + _rnFreed, _nChunk, MEM_DECOMMIT);
+            _rnFreed += _nChunk;
+
+            return false;
+        }
+
+        VirtualFree (_pkPages, 0, MEM_RELEASE);
+        _rnFreed = bytes;
+
+        return true;
+#elif defined(__linux__)
+        size_t chunk = _nChunk < bytes - _rnFreed ? _nChunk : bytes - _rnFreed;
+
+        munmap (static_cast<char*> (_pkPages) + _rnFreed, chunk);
+        _rnFreed += chunk;
+
+        return _rnFreed == bytes;
+#else
+        (void) _nChunk;
+
+        FreePages (_pkPages, _nBytes);
+        _rnFreed = bytes;
+
+        return true;
+#endif
+    }
+
+    // Whole normal pages on NUMA node _nNumaNode, for placement without huge
+    // pages. Rounding to the page size rather than to 2 MB keeps the small
+    // blocks a pool starts with from each taking a huge page of address
+    // space.
+    static void* AllocateNodePages (size_t _nBytes, int _nNumaNode)
+    {
+        size_t bytes = GetNodePageBytes (_nBytes);
+
+#if defined(_WIN32)
+        void* pages = VirtualAllocPages (bytes, MEM_RESERVE | MEM_COMMIT, _nNumaNode);
+        if (pages == nullptr) {
+            throw std::bad_alloc ();
+        }
+
+        return pages;
+#elif defined(__linux__)
+        void* pages = mmap (nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            throw std::bad_alloc ();
+        }
+
+        PreferNumaNode (pages, bytes, _nNumaNode);
+
+        return pages;
+#else
+        (void) _nNumaNode;
+
+        return ::operator new (bytes);
+#endif
+    }
+
+    static void FreeNodePages (void* _pkPages, size_t _nBytes)
+    {
+#if defined(_WIN32)
+        (void) _nBytes;
+
+        VirtualFree (_pkPages, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap (_pkPages, GetNodePageBytes (_nBytes));
+#else
+        (void) _nBytes;
+
+        ::operator delete (_pkPages);
+#endif
+    }
+
+private:
+    static size_t QueryNodePageSize ()
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo (&info);
+
+        return info.dwAllocationGranularity;
+#elif defined(__linux__)
+        long pageSize = sysconf (_SC_PAGESIZE);
+
+        return pageSize > 0 ? static_cast<size_t> (pageSize) : 4096;
+#else
+        return 4096;
+#endif
+    }
+
+#if defined(_WIN32)
+    static void* VirtualAllocPages (size_t _nBytes, DWORD _nType, int _nNumaNode)
+    {
+        if (_nNumaNode >= 0) {
+            return VirtualAllocExNuma (GetCurrentProcess (), nullptr, _nBytes, _nType, PAGE_READWRITE, static_cast<DWORD> (_nNumaNode));
+        }
+
+        return VirtualAlloc (nullptr, _nBytes, _nType, PAGE_READWRITE);
+    }
+#elif defined(__linux__)
+    // Preferred rather than bound, so a full node spills over instead of
+    // failing the allocation.
+    static void PreferNumaNode (void* _pkPages, size_t _nBytes, int _nNumaNode)
+    {
+        if (_nNumaNode < 0 || _nNumaNode > MaxNumaNode) {
+            return;
+        }
+
+        unsigned long mask[(MaxNumaNode + 1) / (8 * sizeof (unsigned long))] = {};
+        mask[_nNumaNode / (8 * sizeof (unsigned long))] |= 1UL << (_nNumaNode % (8 * sizeof (unsigned long)));
+
+        syscall (SYS_mbind, _pkPages, _nBytes, MPOL_PREFERRED, mask, MaxNumaNode + 1, 0);
+    }
+#endif
+};
+
+// Sends allocations of a huge page or more to AllocatePages; for a hash map
+// that is its bucket array once the map is large. Which path an allocation
+// took follows from its size alone, so any two instances can free each
+// other's memory and maps with different settings still swap.
+template<typename T>
+class CRankPageAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+public:
+    CRankPageAllocator ()
+        : m_bHugePages (false)
+        , m_nNumaNode (-1)
+    {
+    }
+
+    CRankPageAllocator (bool _bHugePages, int _nNumaNode)
+        : m_bHugePages (_bHugePages)
+        , m_nNumaNode (_nNumaNode)
+    {
+    }
+
+    template<typename U>
+    CRankPageAllocator (const CRankPageAllocator<U>& _rkAllocator)
+        : m_bHugePages (_rkAllocator.m_bHugePages)
+        , m_nNumaNode (_rkAllocator.m_nNumaNode)
+    {
+    }
+
+    T* allocate (size_t _nSize)
+    {
+        size_t bytes = _nSize * sizeof (T);
+        if (bytes < CRankMemory::HugePageSize) {
+            return static_cast<T*> (::operator new (bytes));
+        }
+
+        return static_cast<T*> (CRankMemory::AllocatePages (bytes, m_bHugePages, m_nNumaNode));
+    }
+
+    void deallocate (T* _pkObjects, size_t _nSize)
+    {
+        size_t bytes = _nSize * sizeof (T);
+        if (bytes < CRankMemory::HugePageSize) {
+            ::operator delete (_pkObjects);
+            return;
+        }
+
+        CRankMemory::FreePages (_pkObjects, bytes);
+    }
+
+    template<typename U>
+    bool operator== (const CRankPageAllocator<U>&) const
+    {
+        return true;
+    }
+
+    bool m_bHugePages;
+    int m_nNumaNode;
+};
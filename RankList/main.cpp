@@ -1,11 +1,55 @@
-#include <chrono>
+﻿#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "RankBoardSet.h"
+#include "RankEventStream.h"
+#include "RankGroupBoard.h"
 #include "RankList.h"
+#include "RankListAsync.h"
+
+class CAccountID
+{
+public:
+    explicit CAccountID (uint64_t _nLow = 0)
+        : m_nHigh (0x5eed5eed5eed5eedull)
+        , m_nLow (_nLow)
+    {
+    }
+
+    bool operator== (const CAccountID&) const = default;
+
+    uint64_t m_nHigh;
+    uint64_t m_nLow;
+};
+
+template<>
+struct std::hash<CAccountID>
+{
+    size_t operator() (const CAccountID& _rkID) const
+    {
+        return std::hash<uint64_t> {} (_rkID.m_nHigh ^ (_rkID.m_nLow * 0x9e3779b97f4a7c15ull));
+    }
+};
+
+std::ostream& operator<< (std::ostream& _rkStream, const CAccountID& _rkID)
+{
+    return _rkStream << std::hex << _rkID.m_nHigh << _rkID.m_nLow << std::dec;
+}
 
-template<int N, int Size = 100000, int Times = 10>
+template<int N, typename TID = int, typename TScore = int, int Size = 100000, int Times = 10>
 void Test ()
 {
-    using TRankList = CRankList<int, int, N>;
+    using TRankList = CRankList<TID, TScore, N>;
 
     long long insert = 0;
     long long update = 0;
@@ -22,7 +66,7 @@ void Test ()
             auto start = std::chrono::steady_clock::now ();
 
             for (int i = 1; i <= Size; i++) {
-                rankList.SetRank (i, rand ());
+                rankList.SetRank (TID (i), TScore (rand ()));
             }
 
             auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
@@ -38,10 +82,10 @@ void Test ()
 
             for (int i = 1; i <= Size; i++) {
                 if (rand () % 2 == 0) {
-                    rankList.SetRank ((rand () % Size) + 1, rand ());
+                    rankList.SetRank (TID ((rand () % Size) + 1), TScore (rand ()));
                 }
                 else {
-                    rankList.RemoveRank ((rand () % Size) + 1);
+                    rankList.RemoveRank (TID ((rand () % Size) + 1));
                 }
             }
 
@@ -52,8 +96,10 @@ void Test ()
         {
             auto start = std::chrono::steady_clock::now ();
 
-            rankList.CheckScore ();
-            rankList.CheckRank ();
+            std::string error;
+            if (!rankList.Validate (error)) {
+                std::cout << "Validate: " << error << std::endl;
+            }
 
             auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
             check += ms.count ();
@@ -63,7 +109,7 @@ void Test ()
             auto start = std::chrono::steady_clock::now ();
 
             for (int i = 1; i <= Size; i++) {
-                rankList.RemoveRank (i);
+                rankList.RemoveRank (TID (i));
             }
 
             auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
@@ -73,27 +119,1341 @@ void Test ()
         rankList.Print ();
     }
 
-    std::cout << "N: " << N << ", Size: " << Size << ", MaxLevel: " << maxLevel << std::endl;
+    std::cout << "N: " << N << ", ID: " << sizeof (TID) << "B, Score: " << sizeof (TScore) << "B, Size: " << Size << ", MaxLevel: " << maxLevel << std::endl;
     std::cout << "Insert: " << insert / 1000.0 / Times << "s, ";
     std::cout << "Update: " << update / 1000.0 / Times << "s, ";
     std::cout << "Check: " << check / 1000.0 / Times << "s, ";
     std::cout << "Remove: " << remove / 1000.0 / Times << "s" << std::endl;
 }
 
-int main ()
+template<int Boards = 1000, int Size = 100000, int Times = 10>
+void TestBoardSet ()
 {
-    srand (static_cast<unsigned int> (time (nullptr)));
+    using TRankBoardSet = CRankBoardSet<int, int, int>;
 
-    //Test<2> ();
-    //Test<3> ();
-    Test<4> ();
-    //Test<5> ();
-    //Test<6> ();
-    //Test<7> ();
-    //Test<8> ();
-    //Test<10> ();
-    //Test<12> ();
-    //Test<14> ();
+    long long insert = 0;
+    long long query = 0;
+    long long remove = 0;
+    TRankBoardSet boardSet;
+    std::vector<std::tuple<int, int, int>> ranks;
+
+    for (int times = Times; times > 0; times--)
+    {
+        boardSet.Clear ();
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size; i++) {
+                boardSet.SetRank (rand () % Boards, (rand () % Size) + 1, rand ());
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            insert += ms.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size; i++) {
+                boardSet.GetRanks (i, ranks);
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            query += ms.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int board = 0; board < Boards; board++) {
+                boardSet.RemoveBoard (board);
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            remove += ms.count ();
+        }
+    }
+
+    std::cout << "Boards: " << Boards << ", Size: " << Size << std::endl;
+    std::cout << "Insert: " << insert / 1000.0 / Times << "s, ";
+    std::cout << "GetRanks: " << query / 1000.0 / Times << "s, ";
+    std::cout << "RemoveBoard: " << remove / 1000.0 / Times << "s" << std::endl;
+}
+
+template<int Groups = 1000, int Size = 100000, int TickSize = 1000, int Times = 10>
+void TestGroupBoard ()
+{
+    using TRankGroupBoard = CRankGroupBoard<int, int, long long>;
+
+    long long direct = 0;
+    long long update = 0;
+    long long query = 0;
+    long long rankSum = 0;
+
+    for (int times = Times; times > 0; times--)
+    {
+        // Previous approach: one list for members and one for groups, with a
+        // group SetRank on every member write.
+        {
+            CRankList<int, long long> memberList;
+            CRankList<int, long long> groupList;
+            std::vector<int> memberGroups (Size + 1, -1);
+            std::vector<long long> groupTotals (Groups, 0);
+
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size * 2; i++)
+            {
+                int id = (rand () % Size) + 1;
+                int group = id % Groups;
+                long long score = rand ();
+
+                if (memberGroups[id] >= 0) {
+                    groupTotals[group] -= memberList.GetScore (id);
+                }
+
+                memberGroups[id] = group;
+                groupTotals[group] += score;
+
+                memberList.SetRank (id, score);
+                groupList.SetRank (group, groupTotals[group]);
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            direct += ms.count ();
+        }
+
+        TRankGroupBoard groupBoard;
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size * 2; i++)
+            {
+                int id = (rand () % Size) + 1;
+                groupBoard.SetRank (id % Groups, id, rand ());
+
+                if (i % TickSize == 0) {
+                    groupBoard.Tick ();
+                }
+            }
+
+            groupBoard.Tick ();
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            update += ms.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size; i++) {
+                rankSum += groupBoard.GetRanks (i).second;
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            query += ms.count ();
+        }
+    }
+
+    std::cout << "Groups: " << Groups << ", Size: " << Size << ", TickSize: " << TickSize << std::endl;
+    std::cout << "Direct: " << direct / 1000.0 / Times << "s, ";
+    std::cout << "Grouped: " << update / 1000.0 / Times << "s, ";
+    std::cout << "GetRanks: " << query / 1000.0 / Times << "s, ";
+    std::cout << "Average member rank: " << rankSum / Times / Size << std::endl;
+}
+
+template<int Threads = 4, int Size = 100000, int Times = 10>
+void TestAsync ()
+{
+    using TRankListAsync = CRankListAsync<int, int>;
+
+    long long ingest = 0;
+    long long flush = 0;
+
+    for (int times = Times; times > 0; times--)
+    {
+        TRankListAsync rankList;
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            std::vector<std::thread> producers;
+            for (int thread = 0; thread < Threads; thread++)
+            {
+                producers.emplace_back ([&rankList, thread] {
+                    for (int i = thread + 1; i <= Size; i += Threads) {
+                        rankList.SetRank (i, i * 7919 % Size);
+                    }
+                });
+            }
+
+            for (auto& producer : producers) {
+                producer.join ();
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            ingest += ms.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            rankList.Flush ();
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            flush += ms.count ();
+        }
+    }
+
+    std::cout << "Threads: " << Threads << ", Size: " << Size << std::endl;
+    std::cout << "Ingest: " << ingest / 1000.0 / Times << "s, ";
+    std::cout << "Flush: " << flush / 1000.0 / Times << "s" << std::endl;
+}
+
+template<int Size = 4000000, int Batch = 200, int Times = 10000>
+void TestBatch ()
+{
+    using TRankList = CRankList<int, int>;
+
+    long long sequential = 0;
+    long long batched = 0;
+    long long checksum = 0;
+    TRankList rankList;
+
+    for (int i = 1; i <= Size; i++) {
+        rankList.SetRank (i, rand ());
+    }
+
+    std::vector<int> ids (Batch);
+    std::vector<std::pair<int, int>> ranks;
+
+    for (int times = Times; times > 0; times--)
+    {
+        for (auto& id : ids) {
+            id = (rand () * (RAND_MAX + 1LL) + rand ()) % Size + 1;
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (auto& id : ids) {
+                checksum += rankList.GetRank (id) + rankList.GetScore (id);
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            sequential += us.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            rankList.GetRanks (ids, ranks);
+            for (auto& rank : ranks) {
+                checksum -= rank.first + rank.second;
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            batched += us.count ();
+        }
+    }
+
+    std::cout << "Size: " << Size << ", Batch: " << Batch << ", Checksum: " << checksum << std::endl;
+    std::cout << "Sequential: " << sequential / 1000.0 / Times << "ms, ";
+    std::cout << "Batched: " << batched / 1000.0 / Times << "ms" << std::endl;
+}
+
+template<int Size = 1000000, int Times = 10>
+void TestClear ()
+{
+    using TRankList = CRankList<int, int>;
+
+    long long clear = 0;
+    long long detach = 0;
+    long long reclaim = 0;
+    TRankList rankList;
+
+    for (int times = Times; times > 0; times--)
+    {
+        for (int i = 1; i <= Size; i++) {
+            rankList.SetRank (i, rand ());
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            rankList.Clear ();
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            clear += us.count ();
+        }
+
+        for (int i = 1; i <= Size; i++) {
+            rankList.SetRank (i, rand ());
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            rankList.ClearIncremental ();
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            detach += us.count ();
+        }
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            long long longest = 0;
+            while (true)
+            {
+                auto step = std::chrono::steady_clock::now ();
+
+                bool isReclaiming = rankList.Reclaim (TRankList::ReclaimSteps);
+
+                auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - step);
+                longest = std::max (longest, static_cast<long long> (us.count ()));
+
+                if (!isReclaiming) {
+                    break;
+                }
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            reclaim += us.count ();
+
+            if (times == 1) {
+                std::cout << "Longest reclaim step: " << longest << "us" << std::endl;
+            }
+        }
+    }
+
+    std::cout << "Size: " << Size << std::endl;
+    std::cout << "Clear: " << clear / 1000.0 / Times << "ms, ";
+    std::cout << "ClearIncremental: " << detach / 1000.0 / Times << "ms, ";
+    std::cout << "Reclaim: " << reclaim / 1000.0 / Times << "ms" << std::endl;
+}
+
+template<int Size = 1000000, int Remain = 10000, int Times = 10>
+void TestRebuild ()
+{
+    using TRankList = CRankList<int, int>;
+
+    long long before = 0;
+    long long rebuild = 0;
+    long long after = 0;
+    long long longest = 0;
+    int fullLevel = 0;
+    int drainLevel = 0;
+    int loadFanout = 8;
+    int fanout = 0;
+    long long checksum = 0;
+
+    for (int times = Times; times > 0; times--)
+    {
+        TRankList rankList;
+
+        // Shaped for the bulk load; the read phase below should bring it
+        // back to the fanout reads are cheapest at.
+        rankList.SetFanout (loadFanout);
+
+        for (int i = 1; i <= Size; i++) {
+            rankList.SetRank (i, rand ());
+        }
+
+        fullLevel = rankList.GetMaxLevel ();
+
+        for (int i = Remain + 1; i <= Size; i++) {
+            rankList.RemoveRank (i);
+        }
+
+        drainLevel = rankList.GetMaxLevel ();
+
+        rankList.SetAutoTune (true);
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int j = 0; j < Size / Remain; j++) {
+                for (int i = 1; i <= Remain; i++) {
+                    checksum += rankList.GetRank (i);
+                }
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            before += us.count ();
+        }
+
+        // The reads above are enough for auto-tune to pick a new fanout on
+        // the next write; drive the rebuild it starts to completion.
+        rankList.SetRank (1, rand ());
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            while (rankList.IsRebuilding () || rankList.IsReclaiming ())
+            {
+                auto step = std::chrono::steady_clock::now ();
+
+                rankList.Rebuild (TRankList::RebuildSteps);
+                rankList.Reclaim (TRankList::ReclaimSteps);
+
+                auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - step);
+                longest = std::max (longest, static_cast<long long> (us.count ()));
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            rebuild += us.count ();
+        }
+
+        fanout = rankList.GetFanout ();
+
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int j = 0; j < Size / Remain; j++) {
+                for (int i = 1; i <= Remain; i++) {
+                    checksum += rankList.GetRank (i);
+                }
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start);
+            after += us.count ();
+        }
+    }
+
+    std::cout << "Rebuild Size: " << Size << ", Remain: " << Remain << ", MaxLevel: " << fullLevel << " -> " << drainLevel << ", Fanout: " << loadFanout << " -> " << fanout << std::endl;
+    std::cout << "GetRank before: " << before / 1000.0 / Times << "ms, ";
+    std::cout << "Rebuild: " << rebuild / 1000.0 / Times << "ms, ";
+    std::cout << "Longest step: " << longest << "us, ";
+    std::cout << "GetRank after: " << after / 1000.0 / Times << "ms, Checksum: " << checksum << std::endl;
+}
+
+template<int Size = 100000, int Window = 100, int Times = 10>
+void TestEvents ()
+{
+    using TRankList = CRankList<int, int>;
+    using TRankEventStream = CRankEventStream<int, int>;
+
+    long long plain = 0;
+    long long unsubscribed = 0;
+    long long subscribed = 0;
+    long long received = 0;
+    long long lost = 0;
+
+    for (int times = Times; times > 0; times--)
+    {
+        {
+            TRankList rankList;
+
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size * 2; i++) {
+                rankList.SetRank ((rand () % Size) + 1, rand ());
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            plain += ms.count ();
+        }
+
+        // A sink without windows should cost no more than no sink at all.
+        {
+            TRankList rankList;
+            TRankEventStream eventStream;
+
+            rankList.SetEventSink (&eventStream);
+
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size * 2; i++) {
+                rankList.SetRank ((rand () % Size) + 1, rand ());
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            unsubscribed += ms.count ();
+
+            rankList.SetEventSink (nullptr);
+        }
+
+        {
+            TRankList rankList;
+            TRankEventStream eventStream;
+            std::atomic<bool> isStopped (false);
+
+            std::thread consumer ([&eventStream, &isStopped, &received, &lost] {
+                uint64_t cursor = eventStream.GetHead ();
+                CRankEvent<int, int> event;
+
+                while (!isStopped.load (std::memory_order_acquire))
+                {
+                    ERankRead result = eventStream.Read (cursor, event);
+                    if (result == ERankRead::Ok) {
+                        received++;
+                    }
+                    else if (result == ERankRead::Lost) {
+                        lost++;
+                    }
+                    else {
+                        std::this_thread::yield ();
+                    }
+                }
+            });
+
+            rankList.SetEventSink (&eventStream);
+            rankList.Subscribe (1, Window);
+
+            auto start = std::chrono::steady_clock::now ();
+
+            for (int i = 1; i <= Size * 2; i++) {
+                rankList.SetRank ((rand () % Size) + 1, rand ());
+            }
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+            subscribed += ms.count ();
+
+            isStopped.store (true, std::memory_order_release);
+            consumer.join ();
+
+            rankList.SetEventSink (nullptr);
+        }
+    }
+
+    std::cout << "Events Size: " << Size << ", Window: " << Window << std::endl;
+    std::cout << "No sink: " << plain / 1000.0 / Times << "s, ";
+    std::cout << "Sink, no window: " << unsubscribed / 1000.0 / Times << "s, ";
+    std::cout << "Subscribed: " << subscribed / 1000.0 / Times << "s, ";
+    std::cout << "Events: " << received / Times << ", Lost: " << lost / Times << std::endl;
+}
+
+// Reference model for the fuzz tests: a multimap in rank order.
+template<typename TID, typename TScore>
+class CRankReference
+{
+public:
+    using TScoreMap = std::multimap<TScore, TID, std::greater<TScore>>;
+
+public:
+    void SetRank (const TID& _nID, const TScore& _nScore)
+    {
+        RemoveRank (_nID);
+        m_kIDs.emplace (_nID, m_kScores.emplace (_nScore, _nID));
+    }
+
+    void RemoveRank (const TID& _nID)
+    {
+        auto it = m_kIDs.find (_nID);
+        if (it == m_kIDs.end ()) {
+            return;
+        }
+
+        m_kScores.erase (it->second);
+        m_kIDs.erase (it);
+    }
+
+    void Clear ()
+    {
+        m_kScores.clear ();
+        m_kIDs.clear ();
+    }
+
+    int GetSize () const
+    {
+        return static_cast<int> (m_kIDs.size ());
+    }
+
+    bool GetScore (const TID& _nID, TScore& _rkScore) const
+    {
+        auto it = m_kIDs.find (_nID);
+        if (it == m_kIDs.end ()) {
+            return false;
+        }
+
+        _rkScore = it->second->first;
+
+        return true;
+    }
+
+    // Sum of the _nCount highest scores.
+    TScore GetTopSum (int _nCount) const
+    {
+        TScore total = TScore ();
+        for (auto it = m_kScores.begin (); it != m_kScores.end () && _nCount > 0; it++, _nCount--) {
+            total = total + it->first;
+        }
+
+        return total;
+    }
+
+    // Ranks _nID may hold; equal scores can be in any order.
+    std::pair<int, int> GetRankRange (const TID& _nID) const
+    {
+        auto it = m_kIDs.find (_nID);
+        if (it == m_kIDs.end ()) {
+            return std::make_pair (0, 0);
+        }
+
+        const TScore& score = it->second->first;
+
+        int above = static_cast<int> (std::distance (m_kScores.begin (), m_kScores.lower_bound (score)));
+        int equal = static_cast<int> (m_kScores.count (score));
+
+        return std::make_pair (above + 1, above + equal);
+    }
+
+private:
+    TScoreMap m_kScores;
+    std::unordered_map<TID, typename TScoreMap::iterator> m_kIDs;
+};
+
+// Validates the structure, then compares the whole list and the rank of
+// _nID against the reference.
+template<typename TRankList>
+bool CheckReference (TRankList& _rkRankList, const CRankReference<int, int>& _rkReference, int _nID, std::string& _rkError)
+{
+    if (!_rkRankList.Validate (_rkError)) {
+        return false;
+    }
+
+    std::vector<std::pair<int, int>> rankList;
+    _rkRankList.GetRankList (rankList);
+
+    if (static_cast<int> (rankList.size ()) != _rkReference.GetSize ())
+    {
+        _rkError = "size " + std::to_string (rankList.size ()) + ", reference " + std::to_string (_rkReference.GetSize ());
+        return false;
+    }
+
+    for (auto& entry : rankList)
+    {
+        int score = 0;
+        if (!_rkReference.GetScore (entry.first, score) || score != entry.second)
+        {
+            _rkError = "id " + std::to_string (entry.first) + " has score " + std::to_string (entry.second);
+            return false;
+        }
+    }
+
+    auto range = _rkReference.GetRankRange (_nID);
+
+    int rank = _rkRankList.GetRank (_nID);
+    if (rank < range.first || rank > range.second)
+    {
+        _rkError = "id " + std::to_string (_nID) + " rank " + std::to_string (rank) + ", reference " + std::to_string (range.first) + "-" + std::to_string (range.second);
+        return false;
+    }
+
+    return true;
+}
+
+// Replays window events into a copy of each window. Leave and Move must
+// name the ID the copy holds at the old rank, so after every write the copy
+// has to match GetRankList for the window.
+class CRankWindowMirror : public CRankEventSink<int, int>
+{
+public:
+    class CRankWindow
+    {
+    public:
+        CRankWindow ()
+            : m_nRank (0)
+            , m_nSize (0)
+        {
+        }
+
+        int m_nRank;
+        int m_nSize;
+        std::vector<std::pair<int, int>> m_kEntries;
+    };
+
+public:
+    void Subscribe (CRankList<int, int>& _rkRankList, int _nRank, int _nSize)
+    {
+        int window = _rkRankList.Subscribe (_nRank, _nSize);
+        if (window >= static_cast<int> (m_kWindows.size ())) {
+            m_kWindows.resize (window + 1);
+        }
+
+        m_kWindows[window].m_nRank = _nRank;
+        m_kWindows[window].m_nSize = _nSize;
+        _rkRankList.GetRankList (_nRank, _nSize, m_kWindows[window].m_kEntries);
+    }
+
+    void PushEvent (const CRankEvent<int, int>& _rkEvent) override
+    {
+        CRankWindow& window = m_kWindows[_rkEvent.m_nWindow];
+
+        if (_rkEvent.m_eType == ERankEvent::Reset)
+        {
+            window.m_kEntries.clear ();
+            return;
+        }
+
+        if (_rkEvent.m_eType == ERankEvent::Leave || _rkEvent.m_eType == ERankEvent::Move)
+        {
+            int index = _rkEvent.m_nOldRank - window.m_nRank;
+            if (index < 0 || index >= static_cast<int> (window.m_kEntries.size ()) || window.m_kEntries[index].first != _rkEvent.m_nID)
+            {
+                m_kError = "event for id " + std::to_string (_rkEvent.m_nID) + " at rank " + std::to_string (_rkEvent.m_nOldRank) + " not in window";
+                return;
+            }
+
+            window.m_kEntries.erase (window.m_kEntries.begin () + index);
+        }
+
+        if (_rkEvent.m_eType == ERankEvent::Enter || _rkEvent.m_eType == ERankEvent::Move)
+        {
+            int index = _rkEvent.m_nNewRank - window.m_nRank;
+            if (index < 0 || index > static_cast<int> (window.m_kEntries.size ()))
+            {
+                m_kError = "event for id " + std::to_string (_rkEvent.m_nID) + " enters at rank " + std::to_string (_rkEvent.m_nNewRank);
+                return;
+            }
+
+            window.m_kEntries.emplace (window.m_kEntries.begin () + index, _rkEvent.m_nID, _rkEvent.m_nScore);
+        }
+    }
+
+    bool Check (CRankList<int, int>& _rkRankList, std::string& _rkError)
+    {
+        if (!m_kError.empty ())
+        {
+            _rkError = m_kError;
+            return false;
+        }
+
+        std::vector<std::pair<int, int>> rankList;
+
+        for (auto& window : m_kWindows)
+        {
+            _rkRankList.GetRankList (window.m_nRank, window.m_nSize, rankList);
+
+            if (rankList != window.m_kEntries)
+            {
+                _rkError = "window at rank " + std::to_string (window.m_nRank) + " has " + std::to_string (window.m_kEntries.size ()) + " entries, list " + std::to_string (rankList.size ());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    std::vector<CRankWindow> m_kWindows;
+    std::string m_kError;
+};
+
+// Random operations on one list, checked against the reference after every
+// step. Few scores so that ties are common.
+template<int Steps = 20000, int IDs = 256, int Scores = 32, int Seeds = 10>
+void TestFuzz ()
+{
+    using TRankList = CRankList<int, int>;
+
+    int failures = 0;
+    std::string error;
+    std::vector<int> ids;
+    std::vector<std::pair<int, int>> ranks;
+    std::vector<std::pair<int, int>> entries;
+    std::vector<std::pair<int, int>> twinEntries;
+
+    for (int seed = 1; seed <= Seeds; seed++)
+    {
+        std::minstd_rand random (seed);
+
+        CRankWindowMirror mirror;
+        TRankList rankList;
+        CRankReference<int, int> reference;
+
+        // Gets the same writes but never changes shape. The order of ties
+        // only depends on the writes, so the two lists must match exactly
+        // across every rebuild swap, where the reference allows any order.
+        TRankList twinList;
+
+        // Odd seeds watch two windows, even seeds keep the write fast path.
+        bool isWatched = seed % 2 == 1;
+        if (isWatched)
+        {
+            rankList.SetEventSink (&mirror);
+            mirror.Subscribe (rankList, 1, 8);
+            mirror.Subscribe (rankList, static_cast<int> (random () % (IDs / 2)) + 1, 16);
+        }
+
+        for (int step = 0; step < Steps; step++)
+        {
+            int id = static_cast<int> (random () % IDs);
+            int op = static_cast<int> (random () % 100);
+
+            if (op < 55)
+            {
+                int score = static_cast<int> (random () % Scores);
+                rankList.SetRank (id, score);
+                twinList.SetRank (id, score);
+                reference.SetRank (id, score);
+            }
+            else if (op < 86)
+            {
+                rankList.RemoveRank (id);
+                twinList.RemoveRank (id);
+                reference.RemoveRank (id);
+            }
+            else if (op < 87) {
+                rankList.SetPoolReserve (static_cast<int> (random () % 256));
+            }
+            else if (op < 88) {
+                rankList.SetUpperLevel (static_cast<int> (random () % 4));
+            }
+            else if (op < 89) {
+                rankList.SetPlacement (random () % 2 == 0, static_cast<int> (random () % 3) - 1);
+            }
+            else if (op < 90) {
+                rankList.SetAutoTune (random () % 2 == 0);
+            }
+            else if (op < 94)
+            {
+                ids.clear ();
+                for (int i = 0; i < 32; i++) {
+                    ids.emplace_back (static_cast<int> (random () % IDs));
+                }
+
+                rankList.GetRanks (ids, ranks);
+
+                for (size_t i = 0; i < ids.size (); i++)
+                {
+                    auto range = reference.GetRankRange (ids[i]);
+
+                    int score = 0;
+                    reference.GetScore (ids[i], score);
+
+                    if (ranks[i].first < range.first || ranks[i].first > range.second) {
+                        error = "GetRanks id " + std::to_string (ids[i]) + " rank " + std::to_string (ranks[i].first);
+                    }
+                    else if (ranks[i].second != score) {
+                        error = "GetRanks id " + std::to_string (ids[i]) + " score " + std::to_string (ranks[i].second) + ", reference " + std::to_string (score);
+                    }
+                }
+            }
+            else if (op < 96) {
+                rankList.SetFanout (static_cast<int> (random () % 8) + 2);
+            }
+            else if (op < 97) {
+                rankList.StartRebuild ();
+            }
+            else if (op < 98)
+            {
+                rankList.Rebuild (static_cast<int> (random () % 64));
+                rankList.Reclaim (static_cast<int> (random () % 64));
+            }
+            else if (op < 99)
+            {
+                rankList.ClearIncremental ();
+                twinList.Clear ();
+                reference.Clear ();
+            }
+            else
+            {
+                rankList.Clear ();
+                twinList.Clear ();
+                reference.Clear ();
+            }
+
+            if (error.empty () && CheckReference (rankList, reference, id, error))
+            {
+                rankList.GetRankList (entries);
+                twinList.GetRankList (twinEntries);
+
+                if (entries != twinEntries) {
+                    error = "order differs from a list that never rebuilds";
+                }
+                else if (isWatched) {
+                    mirror.Check (rankList, error);
+                }
+            }
+
+            if (!error.empty ())
+            {
+                std::cout << "Fuzz seed " << seed << ", step " << step << ": " << error << std::endl;
+                error.clear ();
+                failures++;
+                break;
+            }
+        }
+    }
+
+    std::cout << "Fuzz CRankList seeds: " << Seeds << ", steps: " << Steps << ", failures: " << failures << std::endl;
+}
+
+template<int Steps = 20000, int Boards = 8, int IDs = 256, int Scores = 32, int Seeds = 10>
+void TestFuzzBoardSet ()
+{
+    using TRankBoardSet = CRankBoardSet<int, int, int>;
+
+    int failures = 0;
+    std::string error;
+
+    for (int seed = 1; seed <= Seeds; seed++)
+    {
+        std::minstd_rand random (seed);
+
+        TRankBoardSet boardSet;
+        std::vector<CRankReference<int, int>> references (Boards);
+
+        for (int step = 0; step < Steps; step++)
+        {
+            int board = static_cast<int> (random () % Boards);
+            int id = static_cast<int> (random () % IDs);
+            int op = static_cast<int> (random () % 100);
+
+            if (op < 60)
+            {
+                int score = static_cast<int> (random () % Scores);
+                boardSet.SetRank (board, id, score);
+                references[board].SetRank (id, score);
+            }
+            else if (op < 99)
+            {
+                boardSet.RemoveRank (board, id);
+                references[board].RemoveRank (id);
+            }
+            else
+            {
+                // Clearing a board in place keeps it in the set, which must
+                // drop its index entries all the same.
+                auto rankBoard = boardSet.GetBoard (board);
+                if (rankBoard != nullptr && id % 2 == 0) {
+                    rankBoard->ClearBoard ();
+                }
+                else {
+                    boardSet.RemoveBoard (board);
+                }
+
+                references[board].Clear ();
+            }
+
+            // The whole set is validated every 16 steps, the touched board
+            // every step.
+            if (step % 16 != 0 || boardSet.Validate (error))
+            {
+                auto rankBoard = boardSet.GetBoard (board);
+                if (rankBoard != nullptr) {
+                    CheckReference (*rankBoard, references[board], id, error);
+                }
+                else if (references[board].GetSize () > 0) {
+                    error = "board " + std::to_string (board) + " is missing";
+                }
+            }
+
+            if (!error.empty ())
+            {
+                std::cout << "Fuzz seed " << seed << ", step " << step << ": " << error << std::endl;
+                error.clear ();
+                failures++;
+                break;
+            }
+        }
+    }
+
+    std::cout << "Fuzz CRankBoardSet seeds: " << Seeds << ", steps: " << Steps << ", failures: " << failures << std::endl;
+}
+
+template<int Steps = 20000, int Groups = 16, int IDs = 256, int Scores = 32, int Seeds = 10>
+void TestFuzzGroupBoard ()
+{
+    using TRankGroupBoard = CRankGroupBoard<int, int, int>;
+
+    int failures = 0;
+    std::string error;
+
+    for (int seed = 1; seed <= Seeds; seed++)
+    {
+        std::minstd_rand random (seed);
+
+        ERankAggregate aggregate = static_cast<ERankAggregate> (seed % 3);
+        int topSize = aggregate == ERankAggregate::Sum ? IDs : (aggregate == ERankAggregate::Max ? 1 : 3);
+
+        TRankGroupBoard groupBoard (aggregate, 3);
+        std::vector<CRankReference<int, int>> references (Groups);
+        CRankReference<int, int> groupReference;
+        std::unordered_map<int, int> memberGroups;
+
+        for (int step = 0; step < Steps; step++)
+        {
+            int group = static_cast<int> (random () % Groups);
+            int id = static_cast<int> (random () % IDs);
+            int op = static_cast<int> (random () % 100);
+
+            auto it = memberGroups.find (id);
+            if (it != memberGroups.end ()) {
+                references[it->second].RemoveRank (id);
+            }
+
+            if (op < 60)
+            {
+                int score = static_cast<int> (random () % Scores);
+                groupBoard.SetRank (group, id, score);
+                references[group].SetRank (id, score);
+                memberGroups[id] = group;
+            }
+            else if (op < 95)
+            {
+                groupBoard.RemoveRank (id);
+                memberGroups.erase (id);
+            }
+            else if (it != memberGroups.end ())
+            {
+                int score = groupBoard.GetScore (id);
+                groupBoard.SetGroup (id, group);
+                references[group].SetRank (id, score);
+                memberGroups[id] = group;
+            }
+
+            if (step % 16 == 0) {
+                groupBoard.Tick ();
+            }
+
+            if (step % 16 != 0 || groupBoard.Validate (error))
+            {
+                auto member = memberGroups.find (id);
+                auto range = member != memberGroups.end () ? references[member->second].GetRankRange (id) : std::make_pair (0, 0);
+
+                int rank = groupBoard.GetRank (id);
+                if (rank < range.first || rank > range.second) {
+                    error = "id " + std::to_string (id) + " rank " + std::to_string (rank) + " in its group";
+                }
+                else if (groupBoard.GetGroupSize (group) != references[group].GetSize ()) {
+                    error = "group " + std::to_string (group) + " size " + std::to_string (groupBoard.GetGroupSize (group));
+                }
+            }
+
+            // Right after a Tick every group total and group rank is current,
+            // so they are compared with a reference built from the members.
+            if (step % 16 == 0 && error.empty ())
+            {
+                groupReference.Clear ();
+                for (int i = 0; i < Groups; i++)
+                {
+                    if (references[i].GetSize () > 0) {
+                        groupReference.SetRank (i, references[i].GetTopSum (topSize));
+                    }
+                }
+
+                for (int i = 0; i < Groups && error.empty (); i++)
+                {
+                    auto range = groupReference.GetRankRange (i);
+
+                    int total = 0;
+                    groupReference.GetScore (i, total);
+
+                    int rank = groupBoard.GetGroupRank (i);
+                    if (rank < range.first || rank > range.second) {
+                        error = "group " + std::to_string (i) + " rank " + std::to_string (rank) + ", reference " + std::to_string (range.first) + "-" + std::to_string (range.second);
+                    }
+                    else if (groupBoard.GetGroupScore (i) != total) {
+                        error = "group " + std::to_string (i) + " total " + std::to_string (groupBoard.GetGroupScore (i)) + ", reference " + std::to_string (total);
+                    }
+                }
+            }
+
+            if (!error.empty ())
+            {
+                std::cout << "Fuzz seed " << seed << ", step " << step << ": " << error << std::endl;
+                error.clear ();
+                failures++;
+                break;
+            }
+        }
+    }
+
+    std::cout << "Fuzz CRankGroupBoard seeds: " << Seeds << ", steps: " << Steps << ", failures: " << failures << std::endl;
+}
+
+// Producers own disjoint IDs so the final state is known, while readers
+// query the list concurrently. Build with -fsanitize=thread to check the
+// locking and queue paths.
+template<int Threads = 4, int Size = 20000, int Steps = 50000, int Times = 4>
+void TestStress ()
+{
+    using TRankListAsync = CRankListAsync<int, int>;
+
+    int failures = 0;
+    std::string error;
+
+    for (int times = Times; times > 0; times--)
+    {
+        TRankListAsync rankList;
+        std::vector<CRankReference<int, int>> references (Threads);
+        std::atomic<bool> isStopped (false);
+        std::atomic<int> unordered (0);
+
+        std::vector<std::thread> readers;
+        for (int thread = 0; thread < Threads; thread++)
+        {
+            readers.emplace_back ([&rankList, &isStopped, &unordered, thread] {
+                std::minstd_rand random (thread + 1);
+                std::vector<int> ids (16);
+                std::vector<std::pair<int, int>> ranks;
+                std::vector<std::pair<int, int>> rankList100;
+
+                while (!isStopped.load (std::memory_order_acquire))
+                {
+                    for (auto& id : ids) {
+                        id = static_cast<int> (random () % Size);
+                    }
+
+                    rankList.GetRank (ids[0]);
+                    rankList.GetRanks (ids, ranks);
+                    rankList.GetRankList (1, 100, rankList100);
+
+                    for (size_t i = 1; i < rankList100.size (); i++)
+                    {
+                        if (rankList100[i - 1].second < rankList100[i].second) {
+                            unordered++;
+                        }
+                    }
+                }
+            });
+        }
+
+        std::vector<std::thread> producers;
+        for (int thread = 0; thread < Threads; thread++)
+        {
+            producers.emplace_back ([&rankList, &references, thread] {
+                std::minstd_rand random (thread + 100);
+
+                for (int step = 0; step < Steps; step++)
+                {
+                    int id = static_cast<int> (random () % (Size / Threads)) * Threads + thread;
+                    if (random () % 4 == 0)
+                    {
+                        rankList.RemoveRank (id);
+                        references[thread].RemoveRank (id);
+                    }
+                    else
+                    {
+                        int score = static_cast<int> (random () % 1000);
+                        rankList.SetRank (id, score);
+                        references[thread].SetRank (id, score);
+                    }
+                }
+            });
+        }
+
+        for (auto& producer : producers) {
+            producer.join ();
+        }
+
+        // Readers stop first, a steady stream of shared locks can keep the
+        // writer waiting.
+        isStopped.store (true, std::memory_order_release);
+        for (auto& reader : readers) {
+            reader.join ();
+        }
+
+        rankList.Flush ();
+
+        CRankReference<int, int> reference;
+        for (int id = 0; id < Size; id++)
+        {
+            int score = 0;
+            if (references[id % Threads].GetScore (id, score)) {
+                reference.SetRank (id, score);
+            }
+        }
+
+        if (unordered.load () > 0) {
+            error = std::to_string (unordered.load ()) + " unordered reads";
+        }
+        else {
+            CheckReference (rankList, reference, 0, error);
+        }
+
+        if (!error.empty ())
+        {
+            std::cout << "Stress: " << error << std::endl;
+            error.clear ();
+            failures++;
+        }
+    }
+
+    std::cout << "Stress threads: " << Threads << ", steps: " << Steps << ", failures: " << failures << std::endl;
+}
+
+// dTLB load misses and last level cache misses of the calling thread. Reads
+// as -1 where perf events are not available.
+class CPerfCounters
+{
+public:
+    static constexpr int Counters = 2;
+
+public:
+    CPerfCounters ()
+    {
+        for (int i = 0; i < Counters; i++)
+        {
+            m_kFds[i] = -1;
+            m_kCounts[i] = -1;
+        }
+
+#ifdef __linux__
+        m_kFds[0] = Open (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        m_kFds[1] = Open (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    CPerfCounters (const CPerfCounters&) = delete;
+
+    virtual ~CPerfCounters ()
+    {
+#ifdef __linux__
+        for (int fd : m_kFds)
+        {
+            if (fd >= 0) {
+                close (fd);
+            }
+        }
+#endif
+    }
+
+    void Start ()
+    {
+#ifdef __linux__
+        for (int fd : m_kFds)
+        {
+            if (fd >= 0)
+            {
+                ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void Stop ()
+    {
+#ifdef __linux__
+        for (int i = 0; i < Counters; i++)
+        {
+            if (m_kFds[i] < 0) {
+                continue;
+            }
+
+            ioctl (m_kFds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            long long count = 0;
+            if (read (m_kFds[i], &count, sizeof (count)) == sizeof (count)) {
+                m_kCounts[i] = count;
+            }
+        }
+#endif
+    }
+
+    long long GetTLBMisses () const
+    {
+        return m_kCounts[0];
+    }
+
+    long long GetLLCMisses () const
+    {
+        return m_kCounts[1];
+    }
+
+private:
+#ifdef __linux__
+    static int Open (uint32_t _nType, uint64_t _nConfig)
+    {
+        perf_event_attr attr {};
+        attr.size = sizeof (attr);
+        attr.type = _nType;
+        attr.config = _nConfig;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        return static_cast<int> (syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+private:
+    int m_kFds[Counters];
+    long long m_kCounts[Counters];
+};
+
+// Random descents over a list much larger than the cache, with the default
+// placement, 2 MB pages, and 2 MB pages with the upper levels in their own
+// arena.
+template<int Size = 4000000, int Times = 1000000, int UpperLevel = 6>
+void TestPages ()
+{
+    using TRankList = CRankList<int, int>;
+
+    const char* names[] = { "Default", "Huge pages", "Huge pages, upper levels" };
+
+    for (int mode = 0; mode < 3; mode++)
+    {
+        TRankList rankList;
+        rankList.SetPlacement (mode > 0, -1);
+        rankList.SetUpperLevel (mode > 1 ? UpperLevel : 0);
+
+        for (int i = 1; i <= Size; i++) {
+            rankList.SetRank (i, rand ());
+        }
+
+        std::vector<std::pair<int, int>> rankList1;
+        long long rankSum = 0;
+
+        CPerfCounters counters;
+
+        auto start = std::chrono::steady_clock::now ();
+        counters.Start ();
+
+        for (int i = 0; i < Times; i++)
+        {
+            rankSum += rankList.GetRank (rand () % Size + 1);
+
+            rankList.GetRankList (rand () % Size + 1, 1, rankList1);
+        }
+
+        counters.Stop ();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start);
+
+        std::cout << names[mode] << ": " << ms.count () << "ms, ";
+        std::cout << "dTLB misses: " << counters.GetTLBMisses () << ", ";
+        std::cout << "LLC misses: " << counters.GetLLCMisses () << ", ";
+        std::cout << "Average rank: " << rankSum / Times << std::endl;
+    }
+}
+
+int main ()
+{
+    srand (static_cast<unsigned int> (time (nullptr)));
+
+    //Test<2> ();
+    //Test<3> ();
+    Test<4> ();
+    //Test<5> ();
+    //Test<6> ();
+    //Test<7> ();
+    //Test<8> ();
+    //Test<10> ();
+    //Test<12> ();
+    //Test<14> ();
+
+    Test<4, uint64_t, double> ();
+    Test<4, CAccountID, double> ();
+
+    TestBoardSet ();
+    TestGroupBoard ();
+    TestAsync ();
+    TestBatch ();
+    TestClear ();
+    TestRebuild ();
+    TestEvents ();
+    TestPages ();
+
+    TestFuzz ();
+    TestFuzzBoardSet ();
+    TestFuzzGroupBoard ();
+    TestStress ();
 
     return 0;
 }
\ No newline at end of file